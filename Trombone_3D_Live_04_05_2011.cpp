@@ -38,44 +38,316 @@ April, 2011
 Gordon Good (velo27 <at> yahoo <dot> com)
 
 */
-#include <MidiUart.h>
+#if defined(USBCON)
+#include <MIDIUSB.h>
+#endif
 #include <Midi.h>
-#include <Debounce.h>
+#include <stddef.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <util/crc16.h>
 
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
 #include "WProgram.h"
+#endif
+struct Config;
 void setup();
-void enableAnalogInput(int pin, boolean enablePullup);
-void enableDigitalInput(int pin, boolean enablePullup);
-void enableDigitalOutput(int pin);
+void enableControlTick();
+void enableADCSampler();
+void updateIdle(byte switches);
+void enterIdle();
+void leaveIdle();
+void wakeFromIdle();
+void sleepUntilInterrupt();
+int adcLatest(byte channel);
+void adcReadBlock(byte channel, int *samples, byte count);
+unsigned int adcLatestTime(byte channel);
+boolean stageDue(byte &countdown, byte period);
+void reportTickOverrun();
+long readFilteredSlide();
+long predictSlide(long slideVal);
+void buildSlideMap(const unsigned int *points);
+void loadSlideCalibration();
+void saveSlideCalibration(const unsigned int *points);
+void saveSlideCalibrationStep();
+void startSlideCalibration();
+void recordSlideCalibrationPoint();
+int slideToPitchBend(long slideVal);
 int getPitchBendFromLinearPot();
 int quantizeSlide(int val);
+void updateSlideLed();
 int getPitchBend();
-unsigned char getRawOvertoneSwitchValue();
-int getOvertoneFromOvertoneSwitches();
-int getMIDINote();
-int getVolumeFromBreathSensor();
-int getVolume();
-int getXValue();
-int getYValue();
-void sendNoteOn(int note, int vel, byte chan, boolean debug);
-void sendNoteOff(int note, int vel, byte chan, boolean debug);
-void sendPitchBend(int pitchBend, boolean debug);
-void sendBreathController(int volume, byte chan, boolean debug);
-void sendXYControllers(int x, int y, byte chan, boolean debug);
+byte readSwitches();
+boolean switchDown(byte switches, int pin);
+unsigned char getRawOvertoneSwitchValue(byte switches);
+boolean chordMayBeIntermediate(unsigned char from, unsigned char to);
+unsigned char settleChord(unsigned char chord);
+void setChordSettleTicks();
+int getOvertoneFromOvertoneSwitches(unsigned char chord);
+int getMIDINote(unsigned char chord);
+long legatoBend(int pitch, int pitchBend);
+void changeNote(int newNote, unsigned int sampleTime);
+void updateBreathOnset();
+void breathOnsetSample(int sample, unsigned int time);
+void startBreathZero();
+boolean breathZeroing();
+void zeroBreathSample(int sample);
+void setBreathLevels();
+void readControllers();
+int routeValue(byte lane);
+boolean setRouteParam(byte lane, byte param, byte value);
+void loadConfig();
+unsigned int configValue(const Config *c, byte param);
+boolean configValid(const Config *c);
+boolean setConfigParam(byte param, unsigned int value);
+void configChanged();
+void saveConfig();
+void saveConfigStep();
+boolean loadConfigChunk(const byte *data, byte length);
+void dumpConfig();
+void midiPortInit();
+void midiQueueNote(byte status, byte data1, byte data2, unsigned int sampleTime);
+void noteQueuePut(byte status, byte data1, byte data2, unsigned int sampleTime);
+void midiQueueController(byte status, byte data1, byte data2, unsigned int sampleTime);
+void midiQueueControllerInOrder(byte status, byte data1, byte data2, unsigned int sampleTime);
+boolean midiQueueSysex(const byte *data, byte length);
+void midiQueueThru(byte status, byte data1, byte data2);
+byte midiDataLength(byte status);
+void readMidiIn();
+void parseMidiIn(byte b);
+void handleMidiIn(byte status, byte data1, byte data2);
+void handleSysexIn(const byte *data, byte length);
+void resetMidiIn();
+void midiInDrop();
+boolean midiTxNext();
+void recordLatency(byte status, unsigned int sampleTime, unsigned int queueTime);
+void transportNote(byte status, byte data1, byte data2, unsigned int sampleTime);
+void transportController(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                         unsigned int sampleTime);
+boolean transportSysex(const byte *data, byte length);
+void transportFlush();
+void dumpLatencyHistograms();
+void enableProfiler();
+void profileRecord(byte stage, unsigned int start);
+void dumpProfile();
+void dumpCounters();
+unsigned int counterValue(byte counter);
+void sendNoteOn(int note, int vel, byte chan, unsigned int sampleTime);
+void sendNoteOff(int note, int vel, byte chan, unsigned int sampleTime);
+void refillControllerBuckets(byte ticks);
+void trackControllerMotion(byte lane, int value);
+boolean controllerMaySend(byte lane, int value, int sentValue, boolean urgent);
+void sendController(byte lane, int value, boolean urgent);
+void sendControllers(boolean urgent);
 void allNotesOff();
-int sendMetaCommand(byte chan, unsigned char value);
+void sendMetaCommand(byte chan, unsigned char value);
+void runSystemCommand(unsigned char value);
+void waitForTxIdle();
+void setUartMode(byte mode);
+boolean queueRecord(const byte *record, byte size);
+void captureSample(byte switches);
+boolean debugging();
+boolean debugHasRoom(byte records);
+boolean queueDebugRecord(byte type, byte channel, unsigned int value);
+void debugRecord(byte type, byte channel, unsigned int value);
 void loop();
 MidiClass Midi;
 
-// If DEBUG == true, then the sketch will print to the serial port what
-// it would send on the MIDI bus.
-const boolean DEBUG = false;
-//const boolean DEBUG = true;
+// In debug mode the sketch sends binary event records describing what it
+// would send on the MIDI bus, instead of the MIDI itself (see DEBUG_SYNC,
+// and host/debugdump to read them). The SYS_DEBUG command turns it on and
+// off; set this to start up in it.
+const boolean DEBUG_AT_STARTUP = false;
+
+// Set LOOP_PROFILER to 1 to time each stage of loop() in CPU cycles with
+// Timer1, keeping the min, mean and max for each. The results are sent on
+// request (see SYS_DUMP_PROFILE). With it at 0 the profiling compiles away.
+#ifndef LOOP_PROFILER
+#define LOOP_PROFILER 0
+#endif
+
+// Body of the few loops that spin until an interrupt has done something.
+// On the hardware there's nothing to do; the host build (see host/)
+// defines it to run its simulated peripherals.
+#ifndef WAIT_FOR_INTERRUPT
+#define WAIT_FOR_INTERRUPT()
+#endif
+
+const byte PROF_SWITCHES = 0; // Panic and meta switch handling
+const byte PROF_PITCH_BEND = 1; // getPitchBend()
+const byte PROF_NOTE = 2; // getMIDINote()
+const byte PROF_READ = 3; // readControllers(), the slide included
+const byte PROF_SEND_NOTE = 4; // sendNoteOn() and sendNoteOff()
+const byte PROF_SEND_CC = 5; // sendControllers()
+const byte PROF_PASS = 6; // The whole pass; its max is the worst-case tick
+const byte PROF_ONSET = 7; // updateBreathOnset()
+const byte PROF_STAGES = 8;
+
+#if LOOP_PROFILER
+#define PROFILE_BEGIN(stage) unsigned int profile_##stage = TCNT1
+#define PROFILE_END(stage) profileRecord(stage, profile_##stage)
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
+
+// Pins are types, so the port, bit and ADC channel behind each one are
+// settled at compile time and reading or writing one is a single
+// instruction (sbi, cbi, sbic...) rather than a trip through
+// digitalWrite()'s lookup tables. DigitalPin<port, bit> is a pin by
+// its port; BoardPin<n> and BoardAnalog<n> are Arduino pin Dn or An on
+// the board being built for, from the board profiles below.
+const byte PIN_PORT_B = 1;
+const byte PIN_PORT_C = 2;
+const byte PIN_PORT_D = 3;
+const byte PIN_PORT_E = 4;
+const byte PIN_PORT_F = 5;
+const byte PIN_PORT_G = 6;
+const byte PIN_PORT_H = 7;
+
+template <byte Port> struct PinPort;
+#define DEFINE_PIN_PORT(letter) \
+  template <> struct PinPort<PIN_PORT_##letter> { \
+    static volatile uint8_t &in() { return PIN##letter; } \
+    static volatile uint8_t &ddr() { return DDR##letter; } \
+    static volatile uint8_t &out() { return PORT##letter; } \
+  };
+DEFINE_PIN_PORT(B)
+DEFINE_PIN_PORT(C)
+DEFINE_PIN_PORT(D)
+#ifdef PORTE
+DEFINE_PIN_PORT(E)
+#endif
+#ifdef PORTF
+DEFINE_PIN_PORT(F)
+#endif
+#ifdef PORTG
+DEFINE_PIN_PORT(G)
+#endif
+#ifdef PORTH
+DEFINE_PIN_PORT(H)
+#endif
+
+template <byte Port, byte Bit>
+struct DigitalPin {
+  /** Make the pin an input, with or without its pullup. */
+  static void input(boolean pullup) {
+    PinPort<Port>::ddr() &= ~_BV(Bit);
+    if (pullup) {
+      PinPort<Port>::out() |= _BV(Bit);
+    } else {
+      PinPort<Port>::out() &= ~_BV(Bit);
+    }
+  }
+  /** Make the pin an output. */
+  static void output() {
+    PinPort<Port>::ddr() |= _BV(Bit);
+  }
+  static void write(boolean high) {
+    if (high) {
+      PinPort<Port>::out() |= _BV(Bit);
+    } else {
+      PinPort<Port>::out() &= ~_BV(Bit);
+    }
+  }
+  static boolean read() {
+    return PinPort<Port>::in() & _BV(Bit);
+  }
+};
+
+template <int Number> struct BoardPin;
+template <int Number> struct BoardAnalog;
+#define BOARD_PIN(number, port, bit) \
+  template <> struct BoardPin<number> : DigitalPin<PIN_PORT_##port, bit> {};
+#define BOARD_ANALOG(number, port, bit, mux) \
+  template <> struct BoardAnalog<number> : DigitalPin<PIN_PORT_##port, bit> { static const byte MUX = mux; };
+
+#if defined(__AVR_ATmega32U4__)
+// Leonardo, Micro and the like
+BOARD_PIN(0, D, 2) BOARD_PIN(1, D, 3) BOARD_PIN(2, D, 1) BOARD_PIN(3, D, 0)
+BOARD_PIN(4, D, 4) BOARD_PIN(5, C, 6) BOARD_PIN(6, D, 7) BOARD_PIN(7, E, 6)
+BOARD_PIN(8, B, 4) BOARD_PIN(9, B, 5) BOARD_PIN(10, B, 6) BOARD_PIN(11, B, 7)
+BOARD_PIN(12, D, 6) BOARD_PIN(13, C, 7)
+BOARD_ANALOG(0, F, 7, 7) BOARD_ANALOG(1, F, 6, 6) BOARD_ANALOG(2, F, 5, 5)
+BOARD_ANALOG(3, F, 4, 4) BOARD_ANALOG(4, F, 1, 1) BOARD_ANALOG(5, F, 0, 0)
+#define SWITCHES_ON_PIND 0
+// No Timer2 on the 32U4; the control tick runs from Timer3 instead
+#define TICK_TCCRA TCCR3A
+#define TICK_TCCRB TCCR3B
+#define TICK_TCNT TCNT3
+#define TICK_OCR OCR3A
+#define TICK_TIMSK TIMSK3
+#define TICK_MODE_A 0
+#define TICK_MODE_B (_BV(WGM32) | _BV(CS31) | _BV(CS30)) // CTC mode, clk/64
+#define TICK_INTERRUPT _BV(OCIE3A)
+#define TICK_vect TIMER3_COMPA_vect
+#define TICK_TIMER_MAX 65535L
+// The DIN port is on USART1
+#define MIDI_UDRE_vect USART1_UDRE_vect
+#define MIDI_RX_vect USART1_RX_vect
+#elif defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+// Mega
+BOARD_PIN(0, E, 0) BOARD_PIN(1, E, 1) BOARD_PIN(2, E, 4) BOARD_PIN(3, E, 5)
+BOARD_PIN(4, G, 5) BOARD_PIN(5, E, 3) BOARD_PIN(6, H, 3) BOARD_PIN(7, H, 4)
+BOARD_PIN(8, H, 5) BOARD_PIN(9, H, 6) BOARD_PIN(10, B, 4) BOARD_PIN(11, B, 5)
+BOARD_PIN(12, B, 6) BOARD_PIN(13, B, 7)
+BOARD_ANALOG(0, F, 0, 0) BOARD_ANALOG(1, F, 1, 1) BOARD_ANALOG(2, F, 2, 2)
+BOARD_ANALOG(3, F, 3, 3) BOARD_ANALOG(4, F, 4, 4) BOARD_ANALOG(5, F, 5, 5)
+#define SWITCHES_ON_PIND 0
+// Four USARTs, so the vectors are numbered; the DIN port is on USART0
+#define MIDI_UDRE_vect USART0_UDRE_vect
+#define MIDI_RX_vect USART0_RX_vect
+#else
+// Uno, Duemilanove and the other ATmega328P and 168 boards
+BOARD_PIN(0, D, 0) BOARD_PIN(1, D, 1) BOARD_PIN(2, D, 2) BOARD_PIN(3, D, 3)
+BOARD_PIN(4, D, 4) BOARD_PIN(5, D, 5) BOARD_PIN(6, D, 6) BOARD_PIN(7, D, 7)
+BOARD_PIN(8, B, 0) BOARD_PIN(9, B, 1) BOARD_PIN(10, B, 2) BOARD_PIN(11, B, 3)
+BOARD_PIN(12, B, 4) BOARD_PIN(13, B, 5)
+BOARD_ANALOG(0, C, 0, 0) BOARD_ANALOG(1, C, 1, 1) BOARD_ANALOG(2, C, 2, 2)
+BOARD_ANALOG(3, C, 3, 3) BOARD_ANALOG(4, C, 4, 4) BOARD_ANALOG(5, C, 5, 5)
+#define SWITCHES_ON_PIND 1
+#define MIDI_UDRE_vect USART_UDRE_vect
+#define MIDI_RX_vect USART_RX_vect
+#endif
+
+#ifndef TICK_vect
+// The control tick runs from Timer2
+#define TICK_TCCRA TCCR2A
+#define TICK_TCCRB TCCR2B
+#define TICK_TCNT TCNT2
+#define TICK_OCR OCR2A
+#define TICK_TIMSK TIMSK2
+#define TICK_MODE_A _BV(WGM21) // CTC mode, no PWM outputs
+#define TICK_MODE_B _BV(CS22) // clk/64
+#define TICK_INTERRUPT _BV(OCIE2A)
+#define TICK_vect TIMER2_COMPA_vect
+#define TICK_TIMER_MAX 255L
+#endif
 
 const int BREATH_PIN = 0; // Breath sensor on analog pin 0
 const int SLIDE_LPOT_PIN = 1; // Slide sensor on analog pin 1
 const int X_SENSOR_PIN = 2; // X sensor hooked to analog pin 2
 const int Y_SENSOR_PIN = 3; // X sensor hooked to analog pin 3
+typedef BoardAnalog<BREATH_PIN> BreathPin;
+typedef BoardAnalog<SLIDE_LPOT_PIN> SlidePin;
+typedef BoardAnalog<X_SENSOR_PIN> XSensorPin;
+typedef BoardAnalog<Y_SENSOR_PIN> YSensorPin;
+
+// The ADC runs continuously from its conversion-complete interrupt,
+// cycling through these channels and keeping the last few samples of
+// each. With the ADC clock at 125 kHz each conversion takes 104 us, so
+// every channel is sampled at about 2.4 kHz.
+const byte ADC_BREATH = 0; // Ring buffer index of the breath sensor
+const byte ADC_SLIDE = 1; // Ring buffer index of the slide sensor
+const byte ADC_X = 2; // Ring buffer index of the X sensor
+const byte ADC_Y = 3; // Ring buffer index of the Y sensor
+const byte ADC_CHANNELS = 4; // Number of channels sampled
+const byte ADC_RING_SIZE = 8; // Samples kept per channel (must be a power of 2)
+const unsigned int ADC_SCAN_US = 416; // Time to sample every channel once
+const byte adcPins[ADC_CHANNELS] = {BreathPin::MUX, SlidePin::MUX, XSensorPin::MUX, YSensorPin::MUX}; // ADMUX channels
 
 const int OT_SW_0_PIN = 3; // Overtone switch 0
 const int OT_SW_1_PIN = 4; // Overtone switch 1
@@ -86,6 +358,24 @@ const int META_SW_PIN = 2; // Meta switch
 const int SLIDE_LED_PIN = 13; //Pin that drives LED that shows slide quantization
 
 const int PANIC_PIN = 7; // MIDI all notes off momentary switch on digital I/O 4
+typedef BoardPin<OT_SW_0_PIN> OtSw0Pin;
+typedef BoardPin<OT_SW_1_PIN> OtSw1Pin;
+typedef BoardPin<OT_SW_2_PIN> OtSw2Pin;
+typedef BoardPin<OT_SW_3_PIN> OtSw3Pin;
+typedef BoardPin<META_SW_PIN> MetaSwPin;
+typedef BoardPin<PANIC_PIN> PanicPin;
+typedef BoardPin<SLIDE_LED_PIN> SlideLedPin;
+const byte SWITCH_MASK = _BV(OT_SW_0_PIN) | _BV(OT_SW_1_PIN) | _BV(OT_SW_2_PIN) | _BV(OT_SW_3_PIN) |
+                         _BV(META_SW_PIN) | _BV(PANIC_PIN); // The switch bits of a snapshot
+
+// A switch snapshot has each switch in the bit for its pin number, as
+// PIND has digital pins 0 - 7 on the Uno. There all the switches are on
+// PORTD, so a single read of PIND samples every one of them at the same
+// instant, and a chord change can't be caught half applied within one
+// reading. On the other boards they're spread over several ports and are
+// read one after another, a few cycles apart.
+typedef char switches_fit_a_snapshot[(OT_SW_0_PIN < 8 && OT_SW_1_PIN < 8 && OT_SW_2_PIN < 8 &&
+                                      OT_SW_3_PIN < 8 && META_SW_PIN < 8 && PANIC_PIN < 8) ? 1 : -1];
 
 // The overtone series this instrument will produce. In this iteration
 // of the instrument, I'm trying a sequence of "overtones" that
@@ -101,23 +391,447 @@ const int OT_6 = 72; // Sixth overtone (C)
 const int OT_7 = 74; // Seventh overtone (D)
 const int OT_NONE = -1; // No overtone key pressed (not possible with ribbon)
 
-// All overtones for this instrument
-const int overtones[8] =    {FUNDAMENTAL, OT_1, OT_2, OT_3, OT_4, OT_5, OT_6, OT_7};
-// Switch values for given overtones. 0xff means that overtone can't be selected.
-const int overtone_sw_values[8] = {0x00, 0x01, 0x03, 0x07, 0x0f, 0x0e, 0x0c, 0x08};
+// All overtones for this instrument, and the switch value (chord) that
+// selects each one. The default notes (see CONFIG_DEFAULTS) and the chord
+// decode table are both generated from this list, so to try an alternate
+// fingering just edit the chords here. Each entry is OT(index, note, chord).
+#define OVERTONE_SERIES(OT) \
+  OT(0, FUNDAMENTAL, 0x00) \
+  OT(1, OT_1, 0x01) \
+  OT(2, OT_2, 0x03) \
+  OT(3, OT_3, 0x07) \
+  OT(4, OT_4, 0x0f) \
+  OT(5, OT_5, 0x0e) \
+  OT(6, OT_6, 0x0c) \
+  OT(7, OT_7, 0x08)
+
+#define OVERTONE_NOTE(i, note, chord) note,
+#define OVERTONE_COUNT(i, note, chord) + 1
+const byte OVERTONES = 0 OVERTONE_SERIES(OVERTONE_COUNT);
+
+// ChordDecode<chord>::value is the index of the overtone a chord selects,
+// or -1 if it isn't a legal chord.
+#define CHORD_MATCH(i, note, ch) (chord == (ch)) ? (i) :
+template<int chord> struct ChordDecode {
+  enum { value = OVERTONE_SERIES(CHORD_MATCH) -1 };
+};
+
+// Fail the build if two overtones share a chord, or a chord needs more than 4 switches.
+#define CHORD_CHECK(i, note, ch) \
+  typedef char chord_##i##_is_unique[(ChordDecode<ch>::value == (i) && (ch) < 16) ? 1 : -1];
+OVERTONE_SERIES(CHORD_CHECK)
+
+// Overtone index for each of the 16 possible switch values, -1 for illegal chords
+const signed char chord_to_overtone[16] PROGMEM = {
+  ChordDecode<0x0>::value, ChordDecode<0x1>::value, ChordDecode<0x2>::value, ChordDecode<0x3>::value,
+  ChordDecode<0x4>::value, ChordDecode<0x5>::value, ChordDecode<0x6>::value, ChordDecode<0x7>::value,
+  ChordDecode<0x8>::value, ChordDecode<0x9>::value, ChordDecode<0xa>::value, ChordDecode<0xb>::value,
+  ChordDecode<0xc>::value, ChordDecode<0xd>::value, ChordDecode<0xe>::value, ChordDecode<0xf>::value
+};
+
+const byte PLAY_CHANNEL = 0; // MIDI channel for notes and controllers
+const byte META_CHANNEL = 1; // MIDI channel for meta commands
+
+// Pressing panic while holding the meta key turns that meta press into a
+// system command, chosen by the chord held when the meta key is released.
+const unsigned char SYS_CALIBRATE_SLIDE = 0x01; // Calibrate the slide positions
+const unsigned char SYS_LEGATO = 0x02; // Step to the next legato mode
+const unsigned char SYS_TOGGLE_SLIDE_QUANT = 0x03; // Turn slide quantization on or off
+const unsigned char SYS_SAVE_CONFIG = 0x04; // Save the settings (see Config) to EEPROM
+const unsigned char SYS_DUMP_LATENCY = 0x0f; // Send the latency histograms
+const unsigned char SYS_DUMP_PROFILE = 0x0e; // Send the loop profile (with LOOP_PROFILER)
+const unsigned char SYS_ZERO_BREATH = 0x07; // Measure the breath sensor's resting level again
+const unsigned char SYS_CAPTURE = 0x08; // Start or stop raw sensor capture
+const unsigned char SYS_DEBUG = 0x0c; // Turn debug mode on or off
+const unsigned char SYS_DUMP_COUNTERS = 0x0d; // Send the error counters
 
 const int MIDI_VOLUME_CC = 7; // The controller number for MIDI volume data
 const int MIDI_BREATH_CC = 2; // The controller number for MIDI breath controller data
 const int X_CC = 16; // The controller number for the X value
 const int Y_CC = 17; // The controller number for the Y value
+const int MIDI_ALL_SOUND_OFF_CC = 120; // Channel mode message: all sound off
+const int MIDI_ALL_NOTES_OFF_CC = 123; // Channel mode message: all notes off
+
+// The control loop runs off a fixed-rate tick from a timer (Timer2, or
+// Timer3 where there's no Timer2; see the board profiles) rather than
+// free-running with a delay(). Each pass of loop() handles one tick, and
+// each stage below runs once every so many ticks.
+#ifndef CONTROL_TICK_RATE
+#define CONTROL_TICK_RATE 1000 // Override from the build to try other rates
+#endif
+const long CONTROL_TICK_HZ = CONTROL_TICK_RATE; // Control tick rate, in Hz (977 - 20000 with the /64 prescaler)
+const long TICK_TIMER_TOP = F_CPU / 64 / CONTROL_TICK_HZ - 1; // Tick timer compare value for the tick rate
+const byte PITCH_BEND_PERIOD = 1; // Read the slide every tick
+const byte NOTE_PERIOD = 1; // Read the overtone switches every tick
+const byte VOLUME_PERIOD = 1; // Read the breath sensor every tick
+const byte XY_PERIOD = 10; // Read the X and Y sensors every 10 ticks
+
+// With nothing going on for IDLE_AFTER_SECONDS (no note, no breath, the slide
+// untouched and the switches still) the sketch goes idle to spare the
+// battery. The ADC takes a single breath sample each tick instead of
+// scanning every channel, loop() only runs every IDLE_TICK_DIVIDER ticks
+// (the breath onset detector still sees every sample, as it does awake),
+// and the CPU sleeps in between. Breath reaching the onset level, or a
+// switch moving, puts it straight back to the full rate, so the first
+// note is at most one tick later than it would have been anyway.
+const unsigned int IDLE_AFTER_SECONDS = 30; // Quiet time before going idle, 0 for never
+const byte IDLE_TICK_DIVIDER = 16; // Ticks per pass of loop() while idle
+
+// The tick rate has to fit the tick timer's compare register (8 bits on Timer2).
+typedef char tick_rate_in_range[(TICK_TIMER_TOP > 0 && TICK_TIMER_TOP <= TICK_TIMER_MAX) ? 1 : -1];
+
+// MIDI status bytes (channel in the low nibble)
+const byte MIDI_NOTE_OFF = 0x80;
+const byte MIDI_NOTE_ON = 0x90;
+const byte MIDI_CONTROL_CHANGE = 0xB0;
+const byte MIDI_PITCH_BEND = 0xE0;
+
+// MIDI goes out through every transport in transports[] at once: always
+// the DIN port, and on chips with native USB (the ATmega32U4 and the
+// like) USB-MIDI as well, so either cable can fail on stage. Those chips
+// have the DIN port on USART1. The UART's interrupt vectors are named
+// per chip, in the board profiles above.
+#if defined(USBCON)
+#define USB_MIDI 1
+#define MIDI_UCSRA UCSR1A
+#define MIDI_UCSRB UCSR1B
+#define MIDI_UCSRC UCSR1C
+#define MIDI_UDR UDR1
+#define MIDI_UBRR UBRR1
+#define MIDI_U2X U2X1
+#define MIDI_UDRIE UDRIE1
+#define MIDI_UDRE UDRE1
+#define MIDI_RXCIE RXCIE1
+#define MIDI_RXEN RXEN1
+#define MIDI_TXEN TXEN1
+#define MIDI_UCSZ1 UCSZ11
+#define MIDI_UCSZ0 UCSZ10
+#define MIDI_FE FE1
+#define MIDI_DOR DOR1
+#else
+#define USB_MIDI 0
+#define MIDI_UCSRA UCSR0A
+#define MIDI_UCSRB UCSR0B
+#define MIDI_UCSRC UCSR0C
+#define MIDI_UDR UDR0
+#define MIDI_UBRR UBRR0
+#define MIDI_U2X U2X0
+#define MIDI_UDRIE UDRIE0
+#define MIDI_UDRE UDRE0
+#define MIDI_RXCIE RXCIE0
+#define MIDI_RXEN RXEN0
+#define MIDI_TXEN TXEN0
+#define MIDI_UCSZ1 UCSZ01
+#define MIDI_UCSZ0 UCSZ00
+#define MIDI_FE FE0
+#define MIDI_DOR DOR0
+#endif
+const long MIDI_BAUD = 31250;
+const byte USB_PACKET_SIZE = 64; // One full-speed bulk packet: 16 USB-MIDI events
+const byte USB_CIN_SYSEX = 0x4; // Code index: SysEx starts or continues
+const byte USB_CIN_SYSEX_END = 0x4; // Plus the number of bytes (1 - 3) in the last event
+
+// MIDI output is queued and drained by the UART data-register-empty
+// interrupt, so the send functions never wait on the wire. Note events
+// have a FIFO lane of their own that always goes out ahead of controllers.
+// Controllers get one slot each, so a newer value simply replaces the
+// stale one if it hasn't gone out yet. The controllers sent along with a
+// note (the pitch bend and breath it starts on) go through the note lane
+// instead, so they reach the synth before the Note On does.
+struct MidiMessage {
+  byte status;
+  byte data1;
+  byte data2;
+  unsigned int sampleTime; // micros() when the reading behind it was taken
+  unsigned int queueTime; // micros() when it was queued
+};
+const byte NOTE_QUEUE_SIZE = 8; // Note events that can be waiting (must be a power of 2)
+const byte CC_SLOTS = 8; // Distinct controllers that can be waiting (at most 8)
+
+// The transmitter uses MIDI running status: a message whose status byte
+// matches the previous one goes out without it. The status byte is still
+// repeated at least this often, so a receiver plugged in mid-phrase
+// locks on quickly.
+const unsigned long RUNNING_STATUS_REFRESH_MS = 300;
+
+// System exclusive messages (latency dumps and the like) go out through a
+// one-message bulk lane, after notes and controllers. A SysEx can't be
+// interrupted once started, so they're kept short.
+const byte MIDI_SYSEX_START = 0xF0;
+const byte MIDI_SYSEX_END = 0xF7;
+const byte SYSEX_ID = 0x7D; // Non-commercial manufacturer ID
+const byte SYSEX_LATENCY_DUMP = 0x01; // Message type: one latency histogram
+const byte SYSEX_PROFILE_DUMP = 0x02; // Message type: one loop profiler stage
+const byte SYSEX_CONFIG_VALUE = 0x03; // Message type: one setting (see Config)
+const byte SYSEX_CONFIG_DATA = 0x04; // Message type: part of a settings dump, also taken in to load one
+const byte SYSEX_COUNTER_DUMP = 0x05; // Message type: one error counter
+const byte SYSEX_BUFFER_SIZE = 64; // Longest SysEx we send
+
+// MIDI in, so the instrument can sit in a chain without a merger. The
+// receive interrupt hands realtime bytes (clock, start, stop...) straight
+// to the transmitter, which slips them in between the bytes of whatever
+// is going out, and rings everything else for loop() to parse. Parsed
+// messages go out on a thru lane, behind our own note events and ahead
+// of our controllers, and count against the link like note events do.
+// Messages for the instrument itself are taken out instead: on
+// META_CHANNEL, a controller pressed (64 and up) at META_CC_BASE + n sends
+// meta command n as the meta key would, and at SYSTEM_CC_BASE + n runs
+// system command n; and SysEx of our own with the types below.
+const byte MIDI_IN_BUFFER_SIZE = 64; // Received bytes waiting to be parsed (must be a power of 2)
+const byte REALTIME_QUEUE_SIZE = 4; // Realtime bytes waiting to go out (must be a power of 2)
+const byte THRU_QUEUE_SIZE = 8; // Thru messages that can be waiting (must be a power of 2)
+const byte MIDI_REALTIME = 0xF8; // Status bytes from here up are realtime
+const byte META_CC_BASE = 20; // Controllers 20 - 35 on META_CHANNEL: meta commands
+const byte SYSTEM_CC_BASE = 102; // Controllers 102 - 117 on META_CHANNEL: system commands
+const byte SYSEX_META = 0x10; // Incoming message type: F0 7D 10 <command> F7 sends a meta command
+const byte SYSEX_SYSTEM = 0x11; // F0 7D 11 <command> F7 runs a system command
+const byte SYSEX_ROUTE = 0x12; // F0 7D 12 <lane> <param> <value> F7 changes a controller route
+const byte SYSEX_CONFIG_GET = 0x13; // F0 7D 13 <param> F7 asks for a setting
+const byte SYSEX_CONFIG_SET = 0x14; // F0 7D 14 <param> <value> F7 changes one
+const byte SYSEX_CONFIG_DUMP = 0x15; // F0 7D 15 F7 asks for all of them
+const byte SYSEX_CONFIG_SAVE = 0x16; // F0 7D 16 F7 saves them to EEPROM, like SYS_SAVE_CONFIG
+const byte SYSEX_CONFIG_DEFAULTS = 0x17; // F0 7D 17 F7 goes back to the defaults, without saving
+
+// Latency instrumentation. Every sample is stamped with micros() when the
+// ADC takes it, the stamp travels with the reading through loop() into
+// the transmit queue, and when the message's last byte is handed to the
+// UART, the time since it was queued and since its sample was taken are
+// added to fixed-width histograms. Stamps are the low 16 bits of
+// micros(), which is plenty for latencies under 65 ms.
+const byte LAT_NOTE = 0; // Message classes
+const byte LAT_PITCH_BEND = 1;
+const byte LAT_CC = 2;
+const byte LAT_CLASSES = 3;
+const byte LAT_QUEUED = 0; // Queued to transmitted
+const byte LAT_SAMPLED = 1; // Sampled to transmitted
+const byte LAT_MEASURES = 2;
+const byte LAT_BUCKETS = 16; // The last bucket holds everything past the end
+const byte LAT_BUCKET_SHIFT = 9; // 512 us per bucket
+
+// Counts of things that went wrong without anything on the wire to show
+// for it, sent by SYS_DUMP_COUNTERS.
+const byte COUNTER_MIDI_IN_DROPPED = 0; // midiInDropped
+const byte COUNTER_TICK_OVERRUNS = 1; // tickOverruns
+const byte COUNTERS = 2;
+
+// The UART normally carries MIDI. Capture and debug mode take it over at
+// 1 Mbaud for fixed-size binary records instead, queued to a ring that the
+// UDRE interrupt drains, so writing one never waits on the link. Nothing
+// goes out on MIDI meanwhile.
+const byte UART_MIDI = 0;
+const byte UART_CAPTURE = 1;
+const byte UART_DEBUG = 2;
+const byte RECORD_BUFFER_SIZE = 64; // Record bytes waiting for the UART (must be a power of 2)
+const unsigned int RECORD_UBRR = 1; // 1 Mbaud from 16 MHz with U2X set
+const unsigned int TX_DRAIN_US = 640; // Two MIDI bytes, for the UART's shift and holding registers
+
+// Raw capture mode (SYS_CAPTURE) streams
+// the newest sample of every ADC channel, plus the switch port, once per
+// CAPTURE_PERIOD ticks, for tuning the filters offline or feeding the
+// host replay harness (host/capture2trace turns a capture into a
+// trace). The ADC keeps running
+// from its interrupt and loop() does everything it normally does, so what
+// is recorded is sampled exactly as it is when playing. A record is
+//
+//   0     CAPTURE_SYNC
+//   1     sequence number, counting every record taken, sent or not
+//   2-3   when the breath sample was taken, low 16 bits of micros(), LSB first
+//   4-7   low 8 bits of the breath, slide, X and Y samples
+//   8     their top 2 bits, breath in bits 0-1 through Y in bits 6-7
+//   9     the switch port
+//   10    XOR of bytes 1 - 9
+//
+// If the link falls behind, whole records are dropped, which shows up as
+// a gap in the sequence numbers.
+const byte CAPTURE_SYNC = 0xA5;
+const byte CAPTURE_RECORD_SIZE = 11;
+const byte CAPTURE_PERIOD = 1; // Ticks between records
+
+// A debug record is one event:
+//
+//   0     DEBUG_SYNC
+//   1     event type (DBG_*)
+//   2     MIDI channel, or which entry of a dump
+//   3-4   value, LSB first
+//   5-6   when it happened, low 16 bits of micros(), LSB first
+//   7     XOR of bytes 1 - 6
+//
+// At 1 Mbaud a record takes 80 us on the wire, against several
+// milliseconds for a line of text at 9600 baud, so debug mode runs with
+// close to the timing it's meant to diagnose. If the ring fills, events
+// are dropped and a DBG_DROPPED record says how many.
+const byte DEBUG_SYNC = 0x5A;
+const byte DEBUG_RECORD_SIZE = 8;
+const byte DBG_NOTE_ON = 0x01; // Channel, note
+const byte DBG_NOTE_OFF = 0x02; // Channel, note
+const byte DBG_PITCH_BEND = 0x03; // Channel, bend (0 - 16383)
+const byte DBG_BREATH = 0x04; // Channel, breath controller value
+const byte DBG_X = 0x05; // Channel, X controller value
+const byte DBG_Y = 0x06; // Channel, Y controller value
+const byte DBG_PANIC = 0x07; // Channel
+const byte DBG_META = 0x08; // Channel, meta command
+const byte DBG_OVERRUN = 0x09; // Overruns so far
+const byte DBG_CAL_POINT = 0x0a; // Calibration step, filtered slide reading
+const byte DBG_LATENCY = 0x0b; // Histogram * 16 + bucket, count
+const byte DBG_PROFILE = 0x0c; // Stage * 4 + 0 (min), 1 (mean) or 2 (max), cycles
+const byte DBG_DROPPED = 0x0d; // Records lost since the last one that got through
+const byte DBG_BREATH_ZERO = 0x0e; // Breath noise (peak to peak), resting level
+const byte DBG_COUNTER = 0x0f; // Counter (COUNTER_*), its value
 
-long ccSendTime = 0;  // Last time we sent continuous data (volume, pb);
-const int MIN_CC_INTERVAL = 10; // Send CC data no more often than this (in milliseconds);
 const int PB_SEND_THRESHOLD = 10; // Only send pitch bend if it's this much different than the current value
 const int VOLUME_SEND_THRESHOLD = 1; // Only send volume change if it's this much differnt that the current value
-const int NOTE_ON_VOLUME_THRESHOLD = 60; // Raw sensor value required to turn on a note
+
+// Continuous controllers share the 31.25 kbaud link through token buckets.
+// Each tick, the bytes the link can carry in a tick (less whatever note
+// events used) are split between the controller lanes by share, and a lane
+// only sends when its bucket holds enough for a message. A lane whose
+// bucket is full passes its spare to the others, highest priority first,
+// so with headroom every lane runs at its base threshold. As a lane's
+// bucket drains, its threshold widens, so under pressure controllers
+// degrade to coarser steps instead of falling behind.
+const byte CC_LANE_PB = 0; // Lanes are in priority order, highest first
+const byte CC_LANE_BREATH = 1;
+const byte CC_LANE_X = 2;
+const byte CC_LANE_Y = 3;
+const byte CC_LANES = 4;
+//
+// Within what the bucket allows, when to send is driven by how the value
+// is moving. A lane sends a change past its threshold at once while the
+// value moves fast or just after it turns around, so glissandi and the
+// peaks of swells are tracked closely. A slow drift is sent at most every
+// CC_SLOW_SEND_MS, and a value that has settled within the threshold of
+// what was sent is brought up to date every CC_KEEPALIVE_MS.
+//
+// Each lane is a route from a sensor to a controller: which ADC channel
+// it reads, how often, the curve that turns a reading into a value, and
+// where the value goes, with the rate-limiting settings above. Every lane
+// is read and sent by the same code, so adding a sensor means adding a
+// row here and one in CONFIG_DEFAULTS. The sensors are fixed; the rest
+// of each route is part of the settings (see Config) and can be changed
+// while playing (see setRouteParam()). routeState holds each lane's
+// latest value. The slide lane, always CC_LANE_PB, is the only one that
+// can use ROUTE_CURVE_SLIDE and sends pitch bend whatever its controller
+// number says.
+const byte ROUTE_CURVE_SLIDE = 0; // The slide map, to pitch bend (see getPitchBend())
+const byte ROUTE_CURVE_BREATH = 1; // The breath table, zeroed (see breathTableOffset)
+const byte ROUTE_CURVE_LINEAR = 2; // 0 - 1023 to 0 - 127
+const byte ROUTE_CURVE_INVERTED = 3; // 0 - 1023 to 127 - 0
+const byte ROUTE_CURVES = 4;
+const byte ROUTE_PARAM_CC = 0; // setRouteParam(): controller number, 0 - 119
+const byte ROUTE_PARAM_CHANNEL = 1; // MIDI channel, 0 - 15
+const byte ROUTE_PARAM_CURVE = 2; // ROUTE_CURVE_*
+const byte ROUTE_PARAM_PERIOD = 3; // Ticks between readings, 1 - 255
+const byte ROUTE_PARAMS = 4;
+const byte ROUTE_CONFIG_PARAMS = 7; // Config parameters per lane (see CONFIG_ROUTE)
+struct RouteConfig {
+  byte cc; // Controller number
+  byte channel; // MIDI channel
+  byte curve; // ROUTE_CURVE_*
+  byte period; // Ticks between readings
+  byte share; // Share of the link, in 256ths
+  int16_t threshold; // Change needed before sending, with headroom
+  int16_t fastSlope; // Smoothed change per reading that counts as fast movement, in 16ths
+} __attribute__((packed));
+// setRouteParam() counts on the ROUTE_PARAM_* settings being the first fields, in order
+typedef char route_params_are_fields[(offsetof(RouteConfig, cc) == ROUTE_PARAM_CC &&
+                                      offsetof(RouteConfig, channel) == ROUTE_PARAM_CHANNEL &&
+                                      offsetof(RouteConfig, curve) == ROUTE_PARAM_CURVE &&
+                                      offsetof(RouteConfig, period) == ROUTE_PARAM_PERIOD) ? 1 : -1];
+const byte routeSensors[CC_LANES] PROGMEM = {ADC_SLIDE, ADC_BREATH, ADC_X, ADC_Y}; // Ring buffer index of each lane's sensor
+
+// The live part of each route
+struct RouteState {
+  byte countdown; // Ticks until the next reading
+  int value; // Latest value, -1 for none (the slide untouched)
+  unsigned int sampleTime; // When the sample behind it was taken (micros)
+  boolean fresh; // Read since sendControllers() last looked at the lane
+};
+
+// The debug record types for controllers follow the lanes
+typedef char debug_types_follow_lanes[(DBG_PITCH_BEND + CC_LANE_Y == DBG_Y) ? 1 : -1];
+const unsigned long CC_SLOW_SEND_MS = 20;
+const unsigned long CC_KEEPALIVE_MS = 200;
+const unsigned long CC_SLOW_SEND_TICKS = CC_SLOW_SEND_MS * CONTROL_TICK_HZ / 1000;
+const unsigned long CC_KEEPALIVE_TICKS = CC_KEEPALIVE_MS * CONTROL_TICK_HZ / 1000;
+const byte SLOPE_FRAC_BITS = 4; // Fractional bits in the smoothed slope (16ths)
+
+// How each controller lane's value has been moving
+struct ControllerMotion {
+  int lastValue; // Value at the previous reading
+  int slope; // Smoothed change per reading, << SLOPE_FRAC_BITS
+  signed char direction; // Direction of the last movement, -1, 0 or 1
+  boolean reversed; // Turned around since the last send
+  unsigned long sentTick; // When the lane last sent
+};
+const long LINK_BYTES_PER_SEC = 31250 / 10; // 10 bits per byte on the wire
+const long TOKENS_PER_BYTE = 256; // Bucket resolution
+const long LINK_TOKENS_PER_TICK = LINK_BYTES_PER_SEC * TOKENS_PER_BYTE / CONTROL_TICK_HZ;
+const long MESSAGE_TOKENS = 3 * TOKENS_PER_BYTE; // Cost of one message
+const long CC_BUCKET_DEPTH = 4 * MESSAGE_TOKENS; // Burst each lane can save up
+const int NOTE_ON_VOLUME_THRESHOLD = 60; // Table index where the breath curve starts (see breathTableOffset)
 const int VOLUME_MAX_VALUE = 500; // Maximum value from the breath sensor.
 
+// The breath sensor's resting reading differs from unit to unit and
+// drifts with temperature, so the levels below are set from a
+// measurement rather than fixed. setup() averages BREATH_ZERO_SAMPLES
+// samples at rest and takes their peak-to-peak spread as the noise
+// (SYS_ZERO_BREATH does it again), and the resting level then follows
+// slow drift while no breath is coming in. A measurement that looks
+// like someone was blowing is thrown away.
+const int BREATH_REST_NOMINAL = 20; // Resting reading assumed until it's measured
+const byte BREATH_NOISE_NOMINAL = 4; // Peak-to-peak noise assumed until it's measured
+const byte BREATH_ZERO_SAMPLES = 64; // Samples to measure the resting level over
+const int BREATH_ZERO_MAX_REST = 150; // Highest believable resting reading
+const int BREATH_ZERO_MAX_NOISE = 30; // Highest believable peak-to-peak noise at rest
+const byte BREATH_FLOOR_FRAC_BITS = 12; // Fractional bits in the resting level
+const byte BREATH_DRIFT_SHIFT = 12; // Drift tracking time constant, in samples, as a power of 2
+
+// Notes are gated by an onset detector that watches every new breath
+// sample rather than waiting for the reading to reach the note-on
+// threshold. An attack starts when the pressure comes up through
+// breathOnsetLevel, which sits a margin above the resting level that
+// depends on the noise, and is confirmed once it has stayed there for
+// ONSET_CONFIRM_SAMPLES samples, which rules out single-sample noise, or
+// straight away once it's ONSET_CONFIRM_MARGIN above rest. The note is on
+// from then until the pressure falls below breathReleaseLevel. Velocity
+// comes from the steepest rise seen during the attack, in raw units per
+// millisecond: ONSET_FULL_SLOPE or more is 127, and a slow swell gets
+// ONSET_MIN_VELOCITY. The breath table is shifted so its curve starts at
+// breathOnsetLevel too.
+const int BREATH_ONSET_MARGIN_MIN = 6; // Least the onset level sits above rest
+const byte BREATH_ONSET_NOISE_FACTOR = 2; // Onset margin in multiples of the peak-to-peak noise
+const int BREATH_RELEASE_HYSTERESIS_MIN = 3; // Least the release level sits below the onset level
+const int ONSET_CONFIRM_MARGIN = 40; // Reading above rest that confirms an attack at once
+const byte ONSET_CONFIRM_SAMPLES = 2; // Samples at or above the onset level to confirm an attack
+const int ONSET_FULL_SLOPE = 400; // Rise per millisecond for velocity 127
+const byte ONSET_MIN_VELOCITY = 16; // Velocity for the gentlest attack
+const byte ONSET_IDLE = 0; // No breath
+const byte ONSET_ATTACK = 1; // Rising through the onset level, not yet confirmed
+const byte ONSET_SOUNDING = 2; // Attack confirmed; the breath gate is open
+
+// Breath response curves. Each maps d, the raw reading above
+// NOTE_ON_VOLUME_THRESHOLD, over a range r of raw values to 0 - 127.
+// Pick one with BREATH_CURVE, or fill in BREATH_CURVE_USER.
+#define BREATH_CURVE_LINEAR(d, r) ((d) * 127L / (r))
+#define BREATH_CURVE_EXP(d, r) ((long) (d) * (d) * 127L / ((long) (r) * (r))) // Slow start, square law
+#define BREATH_CURVE_LOG(d, r) (127L - (long) ((r) - (d)) * ((r) - (d)) * 127L / ((long) (r) * (r))) // Fast start
+#define BREATH_CURVE_USER(d, r) BREATH_CURVE_LINEAR(d, r)
+#define BREATH_CURVE BREATH_CURVE_LINEAR
+
+// The breath table maps every raw breath reading straight to its breath
+// controller value, with the note-on threshold and the maximum built in.
+// It's generated at compile time from BREATH_CURVE, so changing the feel
+// means changing the curve, not the code.
+#define BREATH_ENTRY(raw) ((raw) < NOTE_ON_VOLUME_THRESHOLD ? 0 : (raw) >= VOLUME_MAX_VALUE ? 127 : \
+  BREATH_CURVE((raw) - NOTE_ON_VOLUME_THRESHOLD, VOLUME_MAX_VALUE - NOTE_ON_VOLUME_THRESHOLD))
+#define BREATH_4(i) BREATH_ENTRY(i), BREATH_ENTRY(i + 1), BREATH_ENTRY(i + 2), BREATH_ENTRY(i + 3)
+#define BREATH_16(i) BREATH_4(i), BREATH_4(i + 4), BREATH_4(i + 8), BREATH_4(i + 12)
+#define BREATH_64(i) BREATH_16(i), BREATH_16(i + 16), BREATH_16(i + 32), BREATH_16(i + 48)
+#define BREATH_256(i) BREATH_64(i), BREATH_64(i + 64), BREATH_64(i + 128), BREATH_64(i + 192)
+const byte breath_table[1024] PROGMEM = {
+  BREATH_256(0), BREATH_256(256), BREATH_256(512), BREATH_256(768)
+};
+
 // If a value larger than this is read from a SoftPot, treat it as if the player is not touching it.
 // Note: for some reason, the two SoftPots interact, e.g. just actuating the slide pot gives me
 // no-touch values all above 1000, but when also touching the overtone pot, the values can go
@@ -125,61 +839,883 @@ const int VOLUME_MAX_VALUE = 500; // Maximum value from the breath sensor.
 const int LPOT_NO_TOUCH_VALUE = 1010;  
 const int LPOT_SLIDE_POS_1 = 144; // Value at 1st position
 const int LPOT_SLIDE_POS_7 = 350;  // Value at 7th position
+
+// The slide is oversampled from the ADC ring and then smoothed by a
+// fixed-point one-pole low-pass. Each filter step moves 1/2^SHIFT of the
+// way toward the new reading. With the slide read every tick at 1 kHz,
+// the corner frequency and time constant for each shift are:
+//   1: 80 Hz, 2 ms    2: 40 Hz, 4 ms    3: 20 Hz, 8 ms
+const byte SLIDE_OVERSAMPLE = 4; // Raw samples summed per slide reading (at most ADC_RING_SIZE)
+const byte SLIDE_FILTER_FRAC_BITS = 4; // Fractional bits kept in the filter state
+const byte SLIDE_FILTER_SHIFT = 2; // Sets the corner frequency, see above
+const long SLIDE_SCALE = (long) SLIDE_OVERSAMPLE << SLIDE_FILTER_FRAC_BITS; // Filtered units per raw ADC step
+
+// The slide predictor, which runs after the filter, sends the pitch bend
+// for where the slide will be when the synth hears it rather than where
+// it was: the filtered reading is pushed ahead along the slide's velocity
+// by the filter delay plus the pitch bend's measured sample-to-wire
+// latency, scaled by config.slidePredictPercent (0 turns it off), and
+// never by more than the length of the slide. It backs
+// off as the slide slows, and drops out entirely when it turns round,
+// ramping back in over SLIDE_PREDICT_RAMP_TICKS, so stopping and
+// reversing don't overshoot. The prediction is mapped through the slide
+// map like any reading, so it stops at 1st and 7th position.
+const long SLIDE_FILTER_DELAY_READINGS = (1L << SLIDE_FILTER_SHIFT) - 1; // Group delay of the low-pass, in readings
+const long SLIDE_OVERSAMPLE_DELAY_US = (SLIDE_OVERSAMPLE - 1) * ADC_SCAN_US / 2; // Group delay of the oversampling
+const unsigned long SLIDE_LOOKAHEAD_MAX_US = 20000; // Most latency (past the low-pass) the predictor makes up for
+const long SLIDE_AHEAD_MAX = 1024 * SLIDE_SCALE; // Most it pushes a reading ahead: the whole slide
+const byte SLIDE_PREDICT_AT_STARTUP = 0; // Percent of the latency to look ahead; 100 to cancel it
+const byte SLIDE_VELOCITY_FRAC_BITS = 4; // Fractional bits in the velocity estimate
+const byte SLIDE_VELOCITY_SHIFT = 1; // Smoothing of the velocity estimate, like SLIDE_FILTER_SHIFT
+const int SLIDE_PREDICT_RAMP_TICKS = 16; // Ticks for the prediction to come back after a reversal
+const int SLIDE_PREDICT_FULL = 256; // Full prediction gain
+const unsigned int PB_LATENCY_INITIAL_US = 1000; // Latency assumed until some pitch bends have been sent
+
+// The predictor's arithmetic has to fit a long at the longest look-ahead,
+// with slidePredictPercent at its most (200).
+const long SLIDE_READINGS_MAX = ((SLIDE_FILTER_DELAY_READINGS << 4) + 8 + SLIDE_LOOKAHEAD_MAX_US * CONTROL_TICK_HZ / 62500) * 2;
+typedef char slide_lookahead_fits[(SLIDE_LOOKAHEAD_MAX_US <= 0xffffffffUL / CONTROL_TICK_HZ &&
+                                   SLIDE_READINGS_MAX <= 0x7fffffffL / SLIDE_AHEAD_MAX &&
+                                   SLIDE_AHEAD_MAX <= 0x7fffffffL / SLIDE_PREDICT_FULL) ? 1 : -1];
+
 const int MAX_PITCH_BEND_DOWN = 0; // Pitch bend value for 7th position
 const int PITCH_BEND_NEUTRAL = 16383 / 2; // Neutral pitch bend value
+const int PITCH_BEND_MAX = 16383; // Largest pitch bend value
+const int PB_PER_SEMITONE = 1365; // One slide position; the synth's bend range must be 6 semitones
+
+// What happens when the overtone changes while a note is sounding:
+// LEGATO_OFF sends Note Off for the old note, then the controllers, then
+// Note On for the new note. LEGATO_OVERLAP sends Note On before Note
+// Off, so a mono-legato patch slurs rather than re-attacking. LEGATO_BEND
+// keeps the old note sounding and bends it to the new pitch, as long as
+// the bend fits in the range; it falls back to LEGATO_OVERLAP if not.
+// In both legato modes only the pitch bend goes out ahead of the new
+// note; the breath and XY controllers haven't been changed by the
+// overtone switch, so they're left to the usual rationing. SYS_LEGATO
+// steps through the modes.
+const byte LEGATO_OFF = 0;
+const byte LEGATO_OVERLAP = 1;
+const byte LEGATO_BEND = 2;
+const byte LEGATO_MODES = 3;
+const byte LEGATO_AT_STARTUP = LEGATO_OFF;
+
+// The slide is mapped to pitch bend piecewise-linearly between the readings
+// at each of the seven positions. The readings come from a calibration
+// stored in EEPROM, or are spread evenly between LPOT_SLIDE_POS_1 and
+// LPOT_SLIDE_POS_7 if there's no valid calibration.
+const byte SLIDE_POSITIONS = 7; // 1st through 7th position
+const byte SLIDE_SLOPE_SHIFT = 16; // Fractional bits in the per-segment slopes
+const int SLIDE_CAL_EEPROM_ADDR = 0; // Where the slide calibration lives in EEPROM
+const byte SLIDE_CAL_VERSION = 1; // Bump if SlideCalibration changes
+
+// With slide quantization on, each position snaps to one pitch bend value.
+// Once locked, the slide has to go this far past the edge of a position
+// before it moves to the next, so resting near an edge doesn't flicker.
+const int SLIDE_QUANT_HALF_WIDTH = 683; // Half a position, in pitch bend units
+const int SLIDE_QUANT_HYSTERESIS = 150; // Pitch bend units past the edge before moving on
+const byte SLIDE_QUANT_AT_STARTUP = 0; // 1 to start with slide quantization on
+const int slideQuantValues[SLIDE_POSITIONS] = {0, 1365, 2731, 4096, 5461, 6827, 8191}; // Pitch bend at each position, 7th to 1st
+
+struct SlideCalibration {
+  byte version;
+  unsigned int points[SLIDE_POSITIONS]; // Filtered slide reading at each position
+  unsigned int crc; // CRC-16 of everything above
+};
+
+// Moving between chords, the fingers never land at exactly the same time,
+// so e.g. 0000 -> 0011 passes through 0001 or 0010 for a few ms. A new
+// legal chord that could just be on its way to another one (fingers only
+// going down, or only coming up, the whole way) is only taken once it has
+// been held this long. Any other chord is taken at once; an illegal one
+// doesn't change the note anyway.
+const byte CHORD_SETTLE_MS = 6;
+
+// Everything that's tuned per instrument, gathered in one struct so it
+// can be changed over SysEx (see SYSEX_CONFIG_GET) and saved to EEPROM
+// rather than rebuilt and reflashed. The constants above that seed
+// CONFIG_DEFAULTS are the factory settings; the sketch reads the live
+// values straight out of config. loadConfig() reads the saved settings
+// at startup in one block, falling back on the defaults if there are
+// none, they're from another CONFIG_VERSION, or they don't check out.
+// The breath table's thresholds, the chord fingerings and the MIDI
+// channels for notes and meta commands are built in and stay constants.
+//
+// Over SysEx, a value is three 7-bit bytes, high bits first. Getting or
+// setting one is answered with F0 7D 03 <param> <value> F7, with the
+// value as it now stands (unchanged if a set was out of range or for a
+// parameter there isn't). A dump is a run of F0 7D 04 <version> <offset>
+// <count> <data> <check> F7, CONFIG_CHUNK bytes of Config at a time as
+// two 4-bit data bytes each, high first, with the XOR of the data bytes
+// from the version on as the check. Sent back in order, the same
+// messages load the settings, which take effect once the last one is in
+// if the version matches and every value is in range. Loading or setting
+// doesn't save; SYSEX_CONFIG_SAVE or SYS_SAVE_CONFIG does, a byte per
+// pass, so saving never holds up playing.
+//
+// Each field is a parameter, numbered by its row in configParams, with
+// the range it may take. Parameter numbers are part of the SysEx
+// protocol, so new fields go on the end of both. The layout is what goes
+// over SysEx and into EEPROM, so it's packed and the wider fields are
+// 16 bits whatever an int is where it's built.
+struct Config {
+  byte overtones[OVERTONES]; // MIDI note of each overtone
+  RouteConfig routes[CC_LANES]; // Each controller lane's route
+  byte onsetMarginMin; // BREATH_ONSET_MARGIN_MIN
+  byte onsetNoiseFactor; // BREATH_ONSET_NOISE_FACTOR
+  byte releaseHysteresisMin; // BREATH_RELEASE_HYSTERESIS_MIN
+  int16_t onsetConfirmMargin; // ONSET_CONFIRM_MARGIN
+  byte onsetConfirmSamples; // ONSET_CONFIRM_SAMPLES
+  int16_t onsetFullSlope; // ONSET_FULL_SLOPE
+  byte onsetMinVelocity; // ONSET_MIN_VELOCITY
+  int16_t slideNoTouch; // LPOT_NO_TOUCH_VALUE
+  byte chordSettleMs; // CHORD_SETTLE_MS
+  uint16_t idleAfterSeconds; // IDLE_AFTER_SECONDS
+  byte legatoMode; // LEGATO_*, stepped by SYS_LEGATO
+  byte slideQuant; // Slide quantization on, toggled by SYS_TOGGLE_SLIDE_QUANT
+  byte slidePredictPercent; // SLIDE_PREDICT_AT_STARTUP
+} __attribute__((packed));
+
+const Config CONFIG_DEFAULTS PROGMEM = {
+  {OVERTONE_SERIES(OVERTONE_NOTE)},
+  {
+    {0, PLAY_CHANNEL, ROUTE_CURVE_SLIDE, PITCH_BEND_PERIOD, 112, PB_SEND_THRESHOLD, 384},
+    {MIDI_BREATH_CC, PLAY_CHANNEL, ROUTE_CURVE_BREATH, VOLUME_PERIOD, 80, VOLUME_SEND_THRESHOLD, 12},
+    {X_CC, PLAY_CHANNEL, ROUTE_CURVE_LINEAR, XY_PERIOD, 32, VOLUME_SEND_THRESHOLD, 12},
+    {Y_CC, PLAY_CHANNEL, ROUTE_CURVE_LINEAR, XY_PERIOD, 32, VOLUME_SEND_THRESHOLD, 12}
+  },
+  BREATH_ONSET_MARGIN_MIN, BREATH_ONSET_NOISE_FACTOR, BREATH_RELEASE_HYSTERESIS_MIN,
+  ONSET_CONFIRM_MARGIN, ONSET_CONFIRM_SAMPLES, ONSET_FULL_SLOPE, ONSET_MIN_VELOCITY,
+  LPOT_NO_TOUCH_VALUE,
+  CHORD_SETTLE_MS,
+  IDLE_AFTER_SECONDS,
+  LEGATO_AT_STARTUP, SLIDE_QUANT_AT_STARTUP, SLIDE_PREDICT_AT_STARTUP
+};
+
+struct ConfigParam {
+  byte offset; // Where it is in Config
+  byte size; // 1 or 2 bytes
+  uint16_t low; // Smallest value allowed
+  uint16_t high; // Largest value allowed
+};
+#define CONFIG_PARAM(field, low, high) {offsetof(Config, field), sizeof(((Config *) 0)->field), low, high},
+#define CONFIG_OVERTONE(i, note, chord) CONFIG_PARAM(overtones[i], 0, 127)
+#define CONFIG_ROUTE_PARAMS(lane, curveLow, curveHigh) \
+  CONFIG_PARAM(routes[lane].cc, 0, 119) \
+  CONFIG_PARAM(routes[lane].channel, 0, 15) \
+  CONFIG_PARAM(routes[lane].curve, curveLow, curveHigh) \
+  CONFIG_PARAM(routes[lane].period, 1, 255) \
+  CONFIG_PARAM(routes[lane].share, 0, 255) \
+  CONFIG_PARAM(routes[lane].threshold, 0, PITCH_BEND_MAX) \
+  CONFIG_PARAM(routes[lane].fastSlope, 0, 1024 << SLOPE_FRAC_BITS)
+const ConfigParam configParams[] PROGMEM = {
+  OVERTONE_SERIES(CONFIG_OVERTONE)
+  CONFIG_ROUTE_PARAMS(CC_LANE_PB, ROUTE_CURVE_SLIDE, ROUTE_CURVE_SLIDE)
+  CONFIG_ROUTE_PARAMS(CC_LANE_BREATH, ROUTE_CURVE_SLIDE + 1, ROUTE_CURVES - 1)
+  CONFIG_ROUTE_PARAMS(CC_LANE_X, ROUTE_CURVE_SLIDE + 1, ROUTE_CURVES - 1)
+  CONFIG_ROUTE_PARAMS(CC_LANE_Y, ROUTE_CURVE_SLIDE + 1, ROUTE_CURVES - 1)
+  CONFIG_PARAM(onsetMarginMin, 1, 255)
+  CONFIG_PARAM(onsetNoiseFactor, 0, 15)
+  CONFIG_PARAM(releaseHysteresisMin, 1, 255)
+  CONFIG_PARAM(onsetConfirmMargin, 0, 1023)
+  CONFIG_PARAM(onsetConfirmSamples, 1, 255)
+  CONFIG_PARAM(onsetFullSlope, 1, 1023)
+  CONFIG_PARAM(onsetMinVelocity, 1, 127)
+  CONFIG_PARAM(slideNoTouch, 0, 1023)
+  CONFIG_PARAM(chordSettleMs, 0, 255)
+  CONFIG_PARAM(idleAfterSeconds, 0, 65535)
+  CONFIG_PARAM(legatoMode, 0, LEGATO_MODES - 1)
+  CONFIG_PARAM(slideQuant, 0, 1)
+  CONFIG_PARAM(slidePredictPercent, 0, 200)
+};
+const byte CONFIG_PARAMS = sizeof(configParams) / sizeof(configParams[0]);
+const byte CONFIG_ROUTE = OVERTONES; // Parameter number of the first route's first setting; ROUTE_PARAM_* follow the fields
+
+const byte CONFIG_CHUNK = 16; // Bytes of Config in each SYSEX_CONFIG_DATA
+
+// A dump gives offsets into Config in one data byte, and a chunk is a SysEx we can send and take in
+typedef char config_offsets_fit[(sizeof(Config) < 128 && 8 + 2 * CONFIG_CHUNK <= SYSEX_BUFFER_SIZE) ? 1 : -1];
+
+// Saved settings, after the slide calibration in EEPROM. Bump
+// CONFIG_VERSION whenever Config changes.
+const int CONFIG_EEPROM_ADDR = 64; // Where the settings live in EEPROM
+const byte CONFIG_VERSION = 1;
+struct StoredConfig {
+  byte version;
+  Config config;
+  uint16_t crc; // CRC-16 of everything above
+} __attribute__((packed));
+typedef char config_after_slide_cal[(SLIDE_CAL_EEPROM_ADDR + sizeof(SlideCalibration) <= CONFIG_EEPROM_ADDR &&
+                                     CONFIG_EEPROM_ADDR + sizeof(StoredConfig) <= E2END + 1) ? 1 : -1];
 
 int currentNote = -1; // The MIDI note currently sounding
-int currentPitchBend = PITCH_BEND_NEUTRAL; // The current pitch bend
-int currentVolume = 0; // The current 
-int currentXValue = 0; // The current value of the X controller
-int currentYValue = 0; // The current value of the Y controller
-int slide_quant_mode = 0; // The current slide quantization mode. 0 = disabled, 1 = enabled
+int currentPitch = -1; // The note being played; not currentNote while LEGATO_BEND bends it
+int slideBend = PITCH_BEND_NEUTRAL; // The slide's last pitch bend while touched, with no legato bend
+long slideFilterState = -1; // Smoothed slide value in SLIDE_SCALE units, -1 while not touched
+long slidePredictLast = -1; // Filtered reading at the previous prediction, -1 to start again
+long slideVelocity = 0; // Smoothed change per reading, << SLIDE_VELOCITY_FRAC_BITS
+int slidePredictGain = 0; // How much of the prediction to use, out of SLIDE_PREDICT_FULL
+volatile unsigned int pbLatencyUs = PB_LATENCY_INITIAL_US; // Average pitch bend sample-to-wire time
+long slideMapStart[SLIDE_POSITIONS]; // Filtered slide reading where each segment starts
+int slideMapPitchBend[SLIDE_POSITIONS]; // Pitch bend at the start of each segment
+long slideMapSlope[SLIDE_POSITIONS - 1]; // Pitch bend drop per slide unit, << SLIDE_SLOPE_SHIFT
+int slideCalStep = -1; // Position being calibrated, -1 when not calibrating
+unsigned int slideCalPoints[SLIDE_POSITIONS]; // Readings taken so far during calibration
+SlideCalibration slideCalSave; // Calibration being written to EEPROM
+byte slideCalSaveNext = sizeof(SlideCalibration); // Next byte of it to write, or all done
+long ccTokens[CC_LANES]; // Bucket level for each controller lane
+ControllerMotion ccMotion[CC_LANES]; // Movement of each controller lane's value
+Config config; // The live settings
+Config configLoad; // Settings coming in from SYSEX_CONFIG_DATA
+byte configLoadNext = sizeof(Config); // Offset of the next chunk to load, sizeof(Config) when not loading
+int configReplyParam = -1; // Setting to send a SYSEX_CONFIG_VALUE for, -1 for none
+byte configDumpNext = sizeof(Config); // Offset of the next chunk to dump, or all done
+byte configSaveNext = sizeof(StoredConfig); // Next byte of StoredConfig to write to EEPROM, or all done
+unsigned int configSaveCrc; // Its CRC
+long noteLaneTokens = 0; // Link time used by note events since the last refill
+
+/**
+ * Somewhere MIDI can go. The send functions hand every message to each
+ * transport, and each decides for itself how to carry it; a transport
+ * is flushed at the end of every control tick. Controllers are given
+ * with their lane (CC_LANE_*) and value each time they're read, and the
+ * transport picks which readings to send.
+ */
+class MidiTransport {
+public:
+  virtual void note(byte status, byte data1, byte data2, unsigned int sampleTime) {}
+  virtual void controller(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                          unsigned int sampleTime) {}
+  virtual boolean sysexReady() { return true; }
+  virtual void sysex(const byte *data, byte length) {}
+  virtual void flush() {}
+};
+
+/**
+ * The DIN port: the interrupt-driven UART queues, with the controller
+ * lanes rationed by the token buckets.
+ */
+class DinTransport : public MidiTransport {
+public:
+  DinTransport();
+  void note(byte status, byte data1, byte data2, unsigned int sampleTime);
+  void controller(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                  unsigned int sampleTime);
+  boolean sysexReady();
+  void sysex(const byte *data, byte length);
+private:
+  int sent[CC_LANES]; // Last value sent on each controller lane
+};
+
+#if USB_MIDI
+/**
+ * Class compliant USB-MIDI. Events are gathered into one bulk packet
+ * per control tick (or more, if a tick fills one), and every controller
+ * change is sent, since the bus has bandwidth to spare.
+ */
+class UsbMidiTransport : public MidiTransport {
+public:
+  UsbMidiTransport();
+  void note(byte status, byte data1, byte data2, unsigned int sampleTime);
+  void controller(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                  unsigned int sampleTime);
+  void sysex(const byte *data, byte length);
+  void flush();
+private:
+  void put(byte cin, byte b0, byte b1, byte b2);
+  byte packet[USB_PACKET_SIZE]; // Events waiting for the end of the tick
+  byte length; // Bytes in packet
+  int sent[CC_LANES]; // Last value sent on each controller lane
+};
+#endif
+
+DinTransport dinTransport;
+#if USB_MIDI
+UsbMidiTransport usbTransport;
+#endif
+MidiTransport *const transports[] = {
+  &dinTransport,
+#if USB_MIDI
+  &usbTransport,
+#endif
+};
+const byte TRANSPORTS = sizeof(transports) / sizeof(transports[0]);
+int slideQuantPosition = -1; // Index into slideQuantValues of the locked position, -1 if none
+boolean slideLedLit = false; // Current state of SLIDE_LED_PIN
+byte activeNotes[16]; // Bit (n & 7) of activeNotes[n >> 3] is set while note n sounds on PLAY_CHANNEL
+boolean panicPressed = false; // PANIC_PIN state as of the last tick
 boolean metaMode = false; // If true, we are handing a meta keypress
 unsigned char metaValue = 0; // Value to send when meta key released.
+boolean metaSystem = false; // If true, the meta press is a system command (panic was pressed too)
+
+volatile int adcRing[ADC_CHANNELS][ADC_RING_SIZE]; // Recent samples from each analog channel
+volatile byte adcHead[ADC_CHANNELS]; // Index of the newest sample in each ring
+volatile unsigned int adcTime[ADC_CHANNELS][ADC_RING_SIZE]; // micros() when each sample was taken
+volatile byte adcScans = 0; // Complete passes over all channels, up to 255
+byte adcChannel = 0; // Channel currently being converted
+
+MidiMessage noteQueue[NOTE_QUEUE_SIZE]; // Note lane
+volatile byte noteQueueHead = 0; // Next note event to transmit
+volatile byte noteQueueTail = 0; // Where the next note event is queued
+MidiMessage ccSlots[CC_SLOTS]; // Controller lane, one slot per controller
+byte ccSlotCount = 0; // Slots assigned to a controller so far
+volatile byte ccPending = 0; // Bit n set if ccSlots[n] is waiting to go out
+byte ccRound = 0; // Waiting slots the transmitter is working through before taking new ones
+byte runningStatus = 0; // Last status byte sent, 0 if none
+unsigned long runningStatusTime = 0; // When runningStatus was last actually sent
+byte sysexBuffer[SYSEX_BUFFER_SIZE]; // Bulk lane, one SysEx message
+volatile byte sysexLength = 0; // Bytes in sysexBuffer, 0 if the lane is free
+boolean txSysex = false; // True while sysexBuffer is going out
+byte txMessage[3]; // Message currently going out on the wire
+const byte *txData = txMessage; // Bytes of the message going out
+byte txLength = 0; // Bytes in txData
+byte txIndex = 0; // Next byte of txData to send
+byte txStatus = 0; // Status of the message going out, for the latency histograms
+unsigned int txSampleTime = 0; // Sample stamp of the message going out
+unsigned int txQueueTime = 0; // Queue stamp of the message going out
+boolean txThru = false; // True if the message going out came in on MIDI in
+MidiMessage thruQueue[THRU_QUEUE_SIZE]; // Thru lane
+volatile byte thruQueueHead = 0; // Next thru message to transmit
+volatile byte thruQueueTail = 0; // Where the next thru message is queued
+volatile byte realtimeQueue[REALTIME_QUEUE_SIZE]; // Realtime bytes passing through
+volatile byte realtimeHead = 0; // Next realtime byte to transmit
+volatile byte realtimeTail = 0; // Where the next realtime byte goes
+volatile byte midiInBuffer[MIDI_IN_BUFFER_SIZE]; // Received bytes waiting to be parsed
+volatile byte midiInHead = 0; // Where the next received byte goes
+volatile byte midiInTail = 0; // Next received byte to parse
+volatile unsigned int midiInDropped = 0; // Received bytes or messages lost along the way
+byte midiInStatus = 0; // Running status of the input, 0 if none
+byte midiInData[2]; // Data bytes of the message coming in
+byte midiInCount = 0; // How many of them have come
+boolean midiInSysex = false; // True between an incoming F0 and its F7
+byte midiInSysexBuffer[SYSEX_BUFFER_SIZE]; // The SysEx coming in
+byte midiInSysexLength = 0; // Bytes of it so far; past SYSEX_BUFFER_SIZE, it's too long to keep
+unsigned int latencyHistogram[LAT_CLASSES][LAT_MEASURES][LAT_BUCKETS]; // Message counts per latency bucket
+byte latencyDumpNext = LAT_CLASSES * LAT_MEASURES; // Next histogram to dump, or all done
+byte counterDumpNext = COUNTERS; // Next counter to dump, or all done
+volatile byte uartMode = UART_MIDI; // What the UART is carrying
+byte recordBuffer[RECORD_BUFFER_SIZE]; // Capture or debug records waiting for the UART
+volatile byte recordHead = 0; // Where the next record byte goes
+volatile byte recordTail = 0; // Next record byte to transmit
+byte captureSequence = 0; // Sequence number of the next capture record
+unsigned int debugDropped = 0; // Debug records lost since the last one queued
+byte latencyDumpBucket = 0; // Next bucket to dump in debug mode
+byte captureCountdown = CAPTURE_PERIOD; // Ticks until the next record
+
+#if LOOP_PROFILER
+struct StageProfile {
+  unsigned int minCycles;
+  unsigned int maxCycles;
+  unsigned long totalCycles;
+  unsigned long count;
+};
+StageProfile stageProfile[PROF_STAGES]; // Cycle counts for each stage of loop()
+byte profileDumpNext = PROF_STAGES; // Next stage to dump, or all done
+#endif
+
+volatile byte pendingTicks = 0; // Ticks raised by the timer that loop() hasn't handled yet
+volatile boolean idle = false; // Sampling only the breath, and sleeping between passes
+unsigned long lastActiveTick = 0; // When something last kept us from going idle
+byte idleSwitches = 0xff; // The switch snapshot at the previous pass
+unsigned long controlTicks = 0; // Number of ticks elapsed since startup
+unsigned int tickOverruns = 0; // Number of passes that didn't finish within one tick
+unsigned char settledChord = 0; // The chord we're playing from
+unsigned char candidateChord = 0; // The chord on the switches, if it differs from settledChord
+boolean candidateMayBeIntermediate = false; // True if candidateChord could be a passing chord
+unsigned long candidateTick = 0; // When candidateChord first appeared
+unsigned int chordSettleTicks = 0; // config.chordSettleMs in ticks
+
+byte noteCountdown = 1; // Ticks until the overtone switches are next read
+int note = -1; // Most recent overtone switch reading
+unsigned int noteTime = 0; // When the switches behind it were read (micros)
+RouteState routeState[CC_LANES]; // Settings and latest value of each controller route
+byte onsetState = ONSET_IDLE; // Where the breath onset detector is (ONSET_*)
+int onsetLastSample = 0; // Previous breath sample the detector saw
+unsigned int onsetLastTime = 0; // When it was taken
+byte onsetSamples = 0; // Samples so far in the attack
+int onsetPeakSlope = 0; // Steepest rise in the attack, raw units per millisecond
+boolean breathGate = false; // A confirmed attack is still sounding
+byte onsetVelocity = 127; // Velocity of the last confirmed attack
+unsigned int onsetTime = 0; // When the sample that confirmed it was taken
+long breathFloor = (long) BREATH_REST_NOMINAL << BREATH_FLOOR_FRAC_BITS; // Resting level, << BREATH_FLOOR_FRAC_BITS
+byte breathNoise = BREATH_NOISE_NOMINAL; // Peak-to-peak noise at rest
+int breathOnsetLevel; // Reading that starts an attack
+volatile int idleWakeLevel; // Copy of breathOnsetLevel for ISR(ADC_vect), written with interrupts off
+int breathReleaseLevel; // Reading that ends a note
+int breathConfirmLevel; // Reading that confirms an attack at once
+int breathTableOffset; // Subtracted from a reading to index breath_table
+byte breathZeroCount = 0; // Samples taken towards a resting level, BREATH_ZERO_SAMPLES when done
+long breathZeroSum; // Their total
+int breathZeroMin; // Their lowest
+int breathZeroMax; // Their highest
 
 void setup() {
-  enableDigitalInput(OT_SW_0_PIN, true);
-  enableDigitalInput(OT_SW_1_PIN, true);
-  enableDigitalInput(OT_SW_2_PIN, true);
-  enableDigitalInput(OT_SW_3_PIN, true);
-  enableDigitalInput(META_SW_PIN, true);
-  enableDigitalInput(PANIC_PIN, true);
-  enableDigitalOutput(SLIDE_LED_PIN);
-  enableAnalogInput(BREATH_PIN, false);
-  enableAnalogInput(SLIDE_LPOT_PIN, true);
-  enableAnalogInput(X_SENSOR_PIN, true);
-  enableAnalogInput(Y_SENSOR_PIN, true);
-  
-  if (DEBUG) {
-    Serial.begin(9600);
+  OtSw0Pin::input(true);
+  OtSw1Pin::input(true);
+  OtSw2Pin::input(true);
+  OtSw3Pin::input(true);
+  MetaSwPin::input(true);
+  PanicPin::input(true);
+  SlideLedPin::output();
+  BreathPin::input(false);
+  SlidePin::input(true);
+  XSensorPin::input(true);
+  YSensorPin::input(true);
+  loadConfig();
+  enableADCSampler();
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    routeState[lane].countdown = 1;
+    routeState[lane].value = -1;
+  }
+  setBreathLevels();
+  startBreathZero();
+  while (breathZeroing()) {
+    WAIT_FOR_INTERRUPT();
+    updateBreathOnset();
+  }
+  loadSlideCalibration();
+  
+  midiPortInit();  // Initialize MIDI
+  enableControlTick();
+#if LOOP_PROFILER
+  enableProfiler();
+#endif
+  if (DEBUG_AT_STARTUP) {
+    setUartMode(UART_DEBUG);
+  }
+}
+
+/**
+ * Start the ADC converting in the background. Each conversion-complete
+ * interrupt stores its result and starts the next channel, so nobody
+ * ever waits on analogRead(). Returns once every ring buffer is full.
+ */
+void enableADCSampler() {
+  adcChannel = 0;
+  ADMUX = _BV(REFS0) | adcPins[0];  // AVcc reference
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0) | _BV(ADSC);  // clk/128, start
+  while (adcScans < ADC_RING_SIZE) {
+    // Wait for the rings to fill so the first readings are real ones
+    WAIT_FOR_INTERRUPT();
+  }
+}
+
+/**
+ * ADC conversion complete. Store the sample and move on to the next
+ * channel. The mux is switched before the next conversion starts, so
+ * every sample belongs to the channel it's filed under.
+ */
+ISR(ADC_vect) {
+  int val = ADC;
+  byte ch = adcChannel;
+  byte head = (adcHead[ch] + 1) & (ADC_RING_SIZE - 1);
+  adcRing[ch][head] = val;
+  adcTime[ch][head] = micros();
+  adcHead[ch] = head;
+  if (idle) {
+    if (ch != ADC_BREATH || val < idleWakeLevel) {
+      // Stop, with the mux on the breath sensor for the next tick to sample
+      adcChannel = ADC_BREATH;
+      ADMUX = _BV(REFS0) | adcPins[ADC_BREATH];
+      return;
+    }
+    // Breath is coming in: carry on round the other channels
+    leaveIdle();
+  }
+  if (++ch == ADC_CHANNELS) {
+    ch = 0;
+    if (adcScans < 255) {
+      adcScans++;
+    }
+  }
+  adcChannel = ch;
+  ADMUX = _BV(REFS0) | adcPins[ch];
+  ADCSRA |= _BV(ADSC);
+}
+
+/**
+ * Return the newest sample from an ADC channel.
+ */
+int adcLatest(byte channel) {
+  uint8_t oldSREG = SREG;
+  cli();
+  int val = adcRing[channel][adcHead[channel]];
+  SREG = oldSREG;
+  return val;
+}
+
+/**
+ * Return when the newest sample from an ADC channel was taken, as the
+ * low 16 bits of micros().
+ */
+unsigned int adcLatestTime(byte channel) {
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned int time = adcTime[channel][adcHead[channel]];
+  SREG = oldSREG;
+  return time;
+}
+
+/**
+ * Copy the newest count samples (at most ADC_RING_SIZE) from an ADC
+ * channel, oldest first.
+ */
+void adcReadBlock(byte channel, int *samples, byte count) {
+  uint8_t oldSREG = SREG;
+  cli();
+  byte idx = adcHead[channel] - count + 1;
+  for (byte i = 0; i < count; i++) {
+    samples[i] = adcRing[channel][(idx + i) & (ADC_RING_SIZE - 1)];
+  }
+  SREG = oldSREG;
+}
+
+/**
+ * Start the tick timer generating the control tick. The timer runs in
+ * CTC mode from a /64 prescaler and interrupts once per tick. This takes
+ * the timer away from analogWrite() on its pins (3 and 11 for Timer2 on
+ * the Uno, 5 for Timer3 on the Leonardo), which we don't use.
+ */
+void enableControlTick() {
+  cli();
+  TICK_TCCRA = TICK_MODE_A;
+  TICK_TCCRB = TICK_MODE_B;
+  TICK_TCNT = 0;
+  TICK_OCR = TICK_TIMER_TOP;
+  TICK_TIMSK = TICK_INTERRUPT;
+  sei();
+}
+
+/**
+ * Tick timer compare interrupt. Just counts the tick; all the real work
+ * happens in loop() so that MIDI output never runs in interrupt context.
+ * While idle it also starts the tick's breath sample.
+ */
+ISR(TICK_vect) {
+  if (pendingTicks < 255) {
+    pendingTicks++;
+  }
+  if (idle && !(ADCSRA & _BV(ADSC))) {
+    ADCSRA |= _BV(ADSC);
+  }
+}
+
+#if SWITCHES_ON_PIND
+/**
+ * A switch moved while idle. The pin change interrupt is only enabled
+ * while idle.
+ */
+ISR(PCINT2_vect) {
+  if (idle) {
+    wakeFromIdle();
+  }
+}
+#endif
+
+/**
+ * Go idle once nothing has happened for config.idleAfterSeconds, and come
+ * back as soon as something does. Breath and, on the Uno, the switches
+ * wake us from their interrupts without waiting for this; elsewhere the
+ * switches are only looked at here, every IDLE_TICK_DIVIDER ticks.
+ */
+void updateIdle(byte switches) {
+  boolean active = -1 != currentNote || ONSET_IDLE != onsetState || -1 != slideFilterState ||
+                   ((switches ^ idleSwitches) & SWITCH_MASK) || metaMode || -1 != slideCalStep ||
+                   uartMode == UART_CAPTURE || breathZeroing();
+  idleSwitches = switches;
+  if (active) {
+    lastActiveTick = controlTicks;
+    if (idle) {
+      cli();
+      wakeFromIdle();
+      sei();
+    }
+  } else if (config.idleAfterSeconds && !idle &&
+             controlTicks - lastActiveTick >= (unsigned long) config.idleAfterSeconds * CONTROL_TICK_HZ) {
+    enterIdle();
+  }
+}
+
+/**
+ * Stop scanning the ADC and start sleeping between passes of loop(). The
+ * scan in progress stops at its next conversion.
+ */
+void enterIdle() {
+  cli();
+  idle = true;
+#if SWITCHES_ON_PIND
+  PCMSK2 = SWITCH_MASK;
+  PCIFR = _BV(PCIF2);
+  PCICR |= _BV(PCIE2);
+#endif
+  sei();
+}
+
+/**
+ * Back to the full rate. Called with interrupts off; the caller gets the
+ * ADC going again.
+ */
+void leaveIdle() {
+  idle = false;
+#if SWITCHES_ON_PIND
+  PCICR &= ~_BV(PCIE2);
+#endif
+}
+
+/**
+ * Back to the full rate, and get the ADC scanning again. Called with
+ * interrupts off, other than from the ADC interrupt.
+ */
+void wakeFromIdle() {
+  leaveIdle();
+  if (!(ADCSRA & _BV(ADSC))) {
+    ADCSRA |= _BV(ADSC);
+  }
+}
+
+/**
+ * Sleep until an interrupt, unless one has already brought the next idle
+ * pass due. Idle sleep keeps the timers, the ADC and the UART running.
+ */
+void sleepUntilInterrupt() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (idle && pendingTicks < IDLE_TICK_DIVIDER) {
+    sleep_enable();
+    sei();  // Takes effect after the next instruction, so no wakeup is missed
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+}
+
+/**
+ * Count down a stage's tick counter, and return true if the stage should
+ * run on this tick.
+ */
+boolean stageDue(byte &countdown, byte period) {
+  if (--countdown) {
+    return false;
+  }
+  countdown = period;
+  return true;
+}
+
+/**
+ * Called when a pass of loop() took longer than one tick. The count
+ * goes out with SYS_DUMP_COUNTERS, and in debug mode as it happens.
+ */
+void reportTickOverrun() {
+  tickOverruns++;
+  debugRecord(DBG_OVERRUN, 0, tickOverruns);
+}
+
+
+/**
+ * Read the slide from the ADC ring, oversampled and low-pass filtered.
+ * The result is in SLIDE_SCALE units per raw ADC step. Return -1 if
+ * the player is not touching the sensor, or if any of the samples
+ * comes from a no-touch reading (the finger just landed or lifted).
+ */
+long readFilteredSlide() {
+  int samples[SLIDE_OVERSAMPLE];
+  adcReadBlock(ADC_SLIDE, samples, SLIDE_OVERSAMPLE);
+  long sum = 0;
+  for (byte i = 0; i < SLIDE_OVERSAMPLE; i++) {
+    if (samples[i] > config.slideNoTouch) {
+      slideFilterState = -1;
+      return -1;
+    }
+    sum += samples[i];
+  }
+  sum <<= SLIDE_FILTER_FRAC_BITS;
+  
+  if (-1 == slideFilterState) {
+    // Start from the first reading rather than ramping up from a stale value
+    slideFilterState = sum;
   } else {
-    MidiUart.init();  // Initialize MIDI
+    slideFilterState += (sum - slideFilterState) >> SLIDE_FILTER_SHIFT;
+  }
+  return slideFilterState;
+}
+
+/**
+ * Push a filtered slide reading ahead by the look-ahead, along the
+ * slide's velocity. Returns the reading unchanged with the predictor
+ * off; -1 starts it again. A prediction can be any value, -1 included,
+ * so it says nothing about whether the slide is touched.
+ */
+long predictSlide(long slideVal) {
+  if (-1 == slideVal || 0 == config.slidePredictPercent) {
+    slidePredictLast = -1;
+    return slideVal;
+  }
+  if (-1 == slidePredictLast) {
+    slidePredictLast = slideVal;
+    slideVelocity = 0;
+    slidePredictGain = 0;
+    return slideVal;
+  }
+  
+  long step = (slideVal - slidePredictLast) << SLIDE_VELOCITY_FRAC_BITS;
+  slidePredictLast = slideVal;
+  if ((step > 0 && slideVelocity < 0) || (step < 0 && slideVelocity > 0)) {
+    // Turned round: predict nothing until the new direction is established
+    slidePredictGain = 0;
+    slideVelocity = step;
+    return slideVal;
+  }
+  if (labs(step) < labs(slideVelocity) - (labs(slideVelocity) >> 2)) {
+    // Slowing down; the velocity estimate lags, so back off faster than it
+    slidePredictGain >>= 1;
+  } else if (slidePredictGain < SLIDE_PREDICT_FULL) {
+    slidePredictGain += SLIDE_PREDICT_FULL / SLIDE_PREDICT_RAMP_TICKS;
+  }
+  slideVelocity += (step - slideVelocity) >> SLIDE_VELOCITY_SHIFT;
+  
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned int latency = pbLatencyUs;
+  SREG = oldSREG;
+  unsigned long lookahead = SLIDE_OVERSAMPLE_DELAY_US + latency; // Microseconds, past the low-pass
+  if (lookahead > SLIDE_LOOKAHEAD_MAX_US) {
+    lookahead = SLIDE_LOOKAHEAD_MAX_US;
+  }
+  // Readings ahead, << 4: the low-pass, half a reading for the time each
+  // one stands until the next, and the rest at the live slide period
+  long readings = (SLIDE_FILTER_DELAY_READINGS << 4) + 8 +
+    lookahead * CONTROL_TICK_HZ / config.routes[CC_LANE_PB].period / 62500;
+  readings = readings * config.slidePredictPercent / 100;
+  long ahead = constrain((slideVelocity >> SLIDE_VELOCITY_FRAC_BITS) * readings >> 4, -SLIDE_AHEAD_MAX, SLIDE_AHEAD_MAX);
+  return slideVal + ahead * slidePredictGain / SLIDE_PREDICT_FULL;
+}
+
+/**
+ * Build the piecewise-linear slide map from the slide reading at each
+ * position. The points must be increasing.
+ */
+void buildSlideMap(const unsigned int *points) {
+  for (byte i = 0; i < SLIDE_POSITIONS; i++) {
+    slideMapStart[i] = points[i];
+    slideMapPitchBend[i] = PITCH_BEND_NEUTRAL - (long) i * (PITCH_BEND_NEUTRAL - MAX_PITCH_BEND_DOWN) / (SLIDE_POSITIONS - 1);
+  }
+  for (byte i = 0; i < SLIDE_POSITIONS - 1; i++) {
+    long drop = slideMapPitchBend[i] - slideMapPitchBend[i + 1];
+    slideMapSlope[i] = (drop << SLIDE_SLOPE_SHIFT) / (slideMapStart[i + 1] - slideMapStart[i]);
+  }
+}
+
+/**
+ * Load the slide calibration from EEPROM. If it isn't there or doesn't
+ * check out, fall back to positions evenly spaced between
+ * LPOT_SLIDE_POS_1 and LPOT_SLIDE_POS_7.
+ */
+void loadSlideCalibration() {
+  SlideCalibration cal;
+  eeprom_read_block(&cal, (const void *) SLIDE_CAL_EEPROM_ADDR, sizeof(cal));
+  
+  unsigned int crc = 0xffff;
+  for (byte i = 0; i < sizeof(cal) - sizeof(cal.crc); i++) {
+    crc = _crc16_update(crc, ((byte *) &cal)[i]);
+  }
+  boolean valid = cal.version == SLIDE_CAL_VERSION && cal.crc == crc;
+  for (byte i = 0; valid && i < SLIDE_POSITIONS - 1; i++) {
+    valid = cal.points[i] < cal.points[i + 1];
+  }
+  
+  if (!valid) {
+    for (byte i = 0; i < SLIDE_POSITIONS; i++) {
+      cal.points[i] = LPOT_SLIDE_POS_1 * SLIDE_SCALE + i * (LPOT_SLIDE_POS_7 - LPOT_SLIDE_POS_1) * SLIDE_SCALE / (SLIDE_POSITIONS - 1);
+    }
   }
+  buildSlideMap(cal.points);
 }
 
 /**
- * Enable a pin for analog input, and set its internal pullup.
+ * Start storing a new slide calibration in EEPROM.
+ * saveSlideCalibrationStep() does the writing, as the EEPROM is free.
  */
-void enableAnalogInput(int pin, boolean enablePullup) {
-  pinMode(pin, INPUT);
-  digitalWrite(pin + 14, enablePullup ? HIGH : LOW);
+void saveSlideCalibration(const unsigned int *points) {
+  SlideCalibration &cal = slideCalSave;
+  cal.version = SLIDE_CAL_VERSION;
+  for (byte i = 0; i < SLIDE_POSITIONS; i++) {
+    cal.points[i] = points[i];
+  }
+  unsigned int crc = 0xffff;
+  for (byte i = 0; i < sizeof(cal) - sizeof(cal.crc); i++) {
+    crc = _crc16_update(crc, ((byte *) &cal)[i]);
+  }
+  cal.crc = crc;
+  slideCalSaveNext = 0;
+}
+
+/**
+ * Carry on with a calibration save, a byte at a time like
+ * saveConfigStep(): skip the bytes the EEPROM already holds and start
+ * writing the next one that differs, unless the last write is still
+ * going. Called every pass.
+ */
+void saveSlideCalibrationStep() {
+  while (slideCalSaveNext < sizeof(SlideCalibration) && eeprom_is_ready()) {
+    byte b = ((byte *) &slideCalSave)[slideCalSaveNext];
+    byte *addr = (byte *) SLIDE_CAL_EEPROM_ADDR + slideCalSaveNext++;
+    if (eeprom_read_byte(addr) != b) {
+      eeprom_write_byte(addr, b);
+    }
+  }
 }
 
 /**
- * Enable a pin for digital input, and set its internal pullup.
+ * Enter slide calibration. The player then puts the slide at each
+ * position in turn, 1st to 7th, and taps the meta key at each one.
+ * The slide LED stays lit until calibration is done.
  */
-void enableDigitalInput(int pin, boolean enablePullup) {
-  pinMode(pin, INPUT);
-  digitalWrite(pin, enablePullup ? HIGH : LOW);
+void startSlideCalibration() {
+  slideCalStep = 0;
 }
 
 /**
- * Enable a pin for digital output.
+ * Take the calibration reading for the current position. After the 7th,
+ * save the calibration and start using it, if the readings make sense.
+ * Taps while the slide isn't being touched are ignored.
  */
-void enableDigitalOutput(int pin) {
-  pinMode(pin, OUTPUT);
+void recordSlideCalibrationPoint() {
+  if (-1 == slideFilterState) {
+    return;
+  }
+  slideCalPoints[slideCalStep] = slideFilterState;
+  debugRecord(DBG_CAL_POINT, slideCalStep + 1, slideCalPoints[slideCalStep]);
+  if (++slideCalStep < SLIDE_POSITIONS) {
+    return;
+  }
+  
+  slideCalStep = -1;
+  for (byte i = 0; i < SLIDE_POSITIONS - 1; i++) {
+    if (slideCalPoints[i] >= slideCalPoints[i + 1]) {
+      return; // Out of order, keep the old calibration
+    }
+  }
+  saveSlideCalibration(slideCalPoints);
+  buildSlideMap(slideCalPoints);
 }
 
+/**
+ * Map a filtered slide reading to pitch bend: find its segment, then
+ * interpolate along it with a fixed-point multiply and shift.
+ */
+int slideToPitchBend(long slideVal) {
+  // Coerce out-of-range values (e.g. beyond the slide stops)
+  if (slideVal <= slideMapStart[0]) {
+    return slideMapPitchBend[0];
+  }
+  if (slideVal >= slideMapStart[SLIDE_POSITIONS - 1]) {
+    return slideMapPitchBend[SLIDE_POSITIONS - 1];
+  }
+  byte seg = 0;
+  while (slideVal >= slideMapStart[seg + 1]) {
+    seg++;
+  }
+  return slideMapPitchBend[seg] - (int) (((slideVal - slideMapStart[seg]) * slideMapSlope[seg]) >> SLIDE_SLOPE_SHIFT);
+}
 
 /**
  * Read the slide pot and return a pitch bend value. The values
@@ -193,22 +1729,19 @@ void enableDigitalOutput(int pin) {
  */
  int getPitchBendFromLinearPot() {
   
-  // Get the raw value from the linear pot
-  int slideVal = analogRead(SLIDE_LPOT_PIN);
+  // Get the smoothed value from the linear pot, and where it's headed
+  long slideVal = readFilteredSlide();
+  boolean touched = -1 != slideVal;
+  slideVal = predictSlide(slideVal);
   
-  if (slideVal > LPOT_NO_TOUCH_VALUE) {
+  if (!touched) {
+    slideQuantPosition = -1;
     return -1;
   } else {
-    // Coerce out-of-range values (e.g. beyond the slide stops)
-    int constrainedVal = slideVal;
-    constrainedVal = constrainedVal > LPOT_SLIDE_POS_7 ? LPOT_SLIDE_POS_7 : constrainedVal;
-    constrainedVal = constrainedVal < LPOT_SLIDE_POS_1 ? LPOT_SLIDE_POS_1 : constrainedVal;
-    
-   int  pbVal = map(constrainedVal, LPOT_SLIDE_POS_1, LPOT_SLIDE_POS_7, PITCH_BEND_NEUTRAL, MAX_PITCH_BEND_DOWN);
-   if (pbVal < 0) pbVal = 0;
+    int pbVal = slideToPitchBend(slideVal);
     
     // Quantize slide position, if requested
-    if (slide_quant_mode) {
+    if (config.slideQuant) {
       pbVal = quantizeSlide(pbVal);
     }
     
@@ -232,14 +1765,24 @@ void enableDigitalOutput(int pin) {
  *                             ^^^
  */
 int quantizeSlide(int val) {
-  if (val >= 0 && val <= 683) return 0;
-  if (val >= 684 && val <= 2048) return 1365;
-  if (val >= 2049 && val <= 3413) return 2731;
-  if (val >= 3414 && val <= 4779) return 4096;
-  if (val >= 4780 && val <= 6144) return 5461;
-  if (val >= 6145 && val <= 7509) return 6827;
-  if (val >= 7510 && val <= 8192) return 8191;
-  return 0;
+  // The positions are evenly spaced, so the nearest one is just val * 6 / 8192, rounded
+  int nearest = ((unsigned int) val * 3 + 2048) >> 12;
+  if (-1 == slideQuantPosition || abs(val - slideQuantValues[slideQuantPosition]) > SLIDE_QUANT_HALF_WIDTH + SLIDE_QUANT_HYSTERESIS) {
+    slideQuantPosition = nearest;
+  }
+  return slideQuantValues[slideQuantPosition];
+}
+
+/**
+ * Light the slide LED while a position is locked by slide quantization,
+ * and for the whole of slide calibration.
+ */
+void updateSlideLed() {
+  boolean lit = -1 != slideCalStep || (config.slideQuant && -1 != slideQuantPosition);
+  if (lit != slideLedLit) {
+    slideLedLit = lit;
+    SlideLedPin::write(lit);
+  }
 }
 
 /*
@@ -250,214 +1793,1936 @@ int getPitchBend() {
   return getPitchBendFromLinearPot();
 }
 
-unsigned char getRawOvertoneSwitchValue() {
-  unsigned char val = !digitalRead(OT_SW_0_PIN);
-  val = val << 1 | !digitalRead(OT_SW_1_PIN);
-  val = val << 1 | !digitalRead(OT_SW_2_PIN);
-  val = val << 1 | !digitalRead(OT_SW_3_PIN);
-  return val;
+/**
+ * Take a snapshot of all the switches. Bits are the switch port pins,
+ * and a pressed switch reads as 0, since they pull to ground.
+ */
+byte readSwitches() {
+#if SWITCHES_ON_PIND
+  return PIND;
+#else
+  byte switches = 0xff;
+  if (!OtSw0Pin::read()) switches &= ~_BV(OT_SW_0_PIN);
+  if (!OtSw1Pin::read()) switches &= ~_BV(OT_SW_1_PIN);
+  if (!OtSw2Pin::read()) switches &= ~_BV(OT_SW_2_PIN);
+  if (!OtSw3Pin::read()) switches &= ~_BV(OT_SW_3_PIN);
+  if (!MetaSwPin::read()) switches &= ~_BV(META_SW_PIN);
+  if (!PanicPin::read()) switches &= ~_BV(PANIC_PIN);
+  return switches;
+#endif
 }
 
-
 /**
- * Read the overtone switches and return the appropriate overtone.
- * If an invalid key combination is found, return -1. Note that
- * we invert the values from digitalRead, since these switches 
- * pull to ground, so switch enabled = digital 0.
+ * Return true if the switch on pin is pressed in the given snapshot.
  */
-int getOvertoneFromOvertoneSwitches() {
-  unsigned char val = getRawOvertoneSwitchValue();
-  // now select the appropriate overtone
-  for (int i = 0; i < sizeof(overtone_sw_values); i++)  {
-    if (val == overtone_sw_values[i]) {
-      return i;
-    }
-  }
-  return -1;
+boolean switchDown(byte switches, int pin) {
+  return !(switches & _BV(pin));
 }
 
-int getMIDINote() {
-  int ot = getOvertoneFromOvertoneSwitches();
-  if (-1 == ot) {
-    return currentNote;
-  } else {
-    return overtones[ot];
-  }
+/**
+ * Return the 4-bit chord held on the overtone switches in a snapshot,
+ * switch 0 in the high bit.
+ */
+unsigned char getRawOvertoneSwitchValue(byte switches) {
+  byte pressed = ~switches;
+  unsigned char val = (pressed >> OT_SW_0_PIN) & 1;
+  val = val << 1 | ((pressed >> OT_SW_1_PIN) & 1);
+  val = val << 1 | ((pressed >> OT_SW_2_PIN) & 1);
+  val = val << 1 | ((pressed >> OT_SW_3_PIN) & 1);
+  return val;
 }
 
+
 /**
- * Read the breath sensor and map it to a volume level. For now,
- * this maps to the range 0 - 127 so we can generate MIDI
- * continuous controller information.
+ * Return true if the player could be passing through legal chord "to" on
+ * the way from chord "from" to some other legal chord: either "to" only
+ * adds switches to "from" and that other chord adds more, or "to" only
+ * lifts switches from "from" and that other chord lifts more.
  */
-int getVolumeFromBreathSensor() {
-  int volRawVal = analogRead(BREATH_PIN);
-  if (volRawVal < NOTE_ON_VOLUME_THRESHOLD) {
-    return 0;
-  } else {
-    return map(constrain(volRawVal, NOTE_ON_VOLUME_THRESHOLD, VOLUME_MAX_VALUE), NOTE_ON_VOLUME_THRESHOLD, VOLUME_MAX_VALUE, 0, 127);
+boolean chordMayBeIntermediate(unsigned char from, unsigned char to) {
+  if (-1 == (signed char) pgm_read_byte(&chord_to_overtone[to])) {
+    return false;
   }
+  boolean pressing = 0 == (from & ~to);
+  boolean lifting = 0 == (to & ~from);
+  if (!pressing && !lifting) {
+    return false;
+  }
+  for (unsigned char dest = 0; dest < 16; dest++) {
+    if (dest != to && -1 != (signed char) pgm_read_byte(&chord_to_overtone[dest]) &&
+        0 == (pressing ? to & ~dest : dest & ~to)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-int getVolume() {
-  return getVolumeFromBreathSensor();
-}
-
-int getXValue() {
-  return analogRead(X_SENSOR_PIN);
+/**
+ * Feed the chord on the switches through the settle state machine, and
+ * return the chord to play from. An illegal chord is passed straight
+ * through, but the next chord is still judged against the last legal one.
+ */
+unsigned char settleChord(unsigned char chord) {
+  if (chord == settledChord) {
+    candidateChord = chord;
+    return settledChord;
+  }
+  if (-1 == getOvertoneFromOvertoneSwitches(chord)) {
+    candidateChord = chord;
+    return chord;
+  }
+  if (chord != candidateChord) {
+    candidateChord = chord;
+    candidateTick = controlTicks;
+    candidateMayBeIntermediate = chordMayBeIntermediate(settledChord, chord);
+  }
+  if (!candidateMayBeIntermediate || controlTicks - candidateTick >= chordSettleTicks) {
+    settledChord = chord;
+  }
+  return settledChord;
 }
 
-int getYValue() {
-  return analogRead(Y_SENSOR_PIN);
+/**
+ * Work out how many ticks a possible passing chord has to be held, from
+ * config.chordSettleMs.
+ */
+void setChordSettleTicks() {
+  chordSettleTicks = (unsigned long) config.chordSettleMs * CONTROL_TICK_HZ / 1000;
 }
 
-void sendNoteOn(int note, int vel, byte chan, boolean debug) {
-  if (debug) {
-    Serial.print("ON ");
-    Serial.println(note);
-  } else {
-    MidiUart.sendNoteOn(chan, note, vel);
-  }
+/**
+ * Return the overtone selected by a chord on the overtone switches.
+ * If it's an invalid key combination, return -1.
+ */
+int getOvertoneFromOvertoneSwitches(unsigned char chord) {
+  return (signed char) pgm_read_byte(&chord_to_overtone[chord]);
 }
 
-void sendNoteOff(int note, int vel, byte chan, boolean debug) {
-  if (debug) {
-    Serial.print("OFF ");
-    Serial.println(note);
+int getMIDINote(unsigned char chord) {
+  int ot = getOvertoneFromOvertoneSwitches(chord);
+  if (-1 == ot) {
+    return currentPitch;
   } else {
-    MidiUart.sendNoteOff(chan, note, vel);
+    return config.overtones[ot];
   }
 }
 
-void sendPitchBend(int pitchBend, boolean debug) {
-  if (-1 != pitchBend) {
-    if (abs(currentPitchBend - pitchBend) > PB_SEND_THRESHOLD) {
-      currentPitchBend = pitchBend;
-      if (debug) {
-        Serial.print("BEND ");
-        Serial.println(pitchBend);
-      } else {
-        MidiUart.sendPitchBend(pitchBend);
+/**
+ * Take a new reading on every controller route that's due one, through
+ * its curve.
+ */
+void readControllers() {
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    RouteState &state = routeState[lane];
+    const RouteConfig &route = config.routes[lane];
+    if (!stageDue(state.countdown, route.period)) {
+      continue;
+    }
+    byte channel = pgm_read_byte(&routeSensors[lane]);
+    int raw;
+    switch (route.curve) {
+      case ROUTE_CURVE_SLIDE: {
+        PROFILE_BEGIN(PROF_PITCH_BEND);
+        state.value = getPitchBend();
+        if (-1 != state.value) {
+          slideBend = state.value;
+        }
+        updateSlideLed();
+        PROFILE_END(PROF_PITCH_BEND);
+        break;
       }
+      case ROUTE_CURVE_BREATH:
+        raw = constrain(adcLatest(channel) - breathTableOffset, 0, 1023);
+        state.value = pgm_read_byte(&breath_table[raw]);
+        break;
+      case ROUTE_CURVE_LINEAR:
+        state.value = ((long) adcLatest(channel) * 127) >> 10;
+        break;
+      case ROUTE_CURVE_INVERTED:
+        state.value = 127 - (((long) adcLatest(channel) * 127) >> 10);
+        break;
     }
+    state.sampleTime = adcLatestTime(channel);
+    state.fresh = true;
   }
 }
 
-
-void sendBreathController(int volume, byte chan, boolean debug) {
-  if (abs(currentVolume - volume) > VOLUME_SEND_THRESHOLD) {
-    currentVolume = volume;
-    if (debug) {
-      Serial.print("BC ");
-      Serial.println(volume);
-    } else {
-      MidiUart.sendCC(chan, MIDI_BREATH_CC, volume );
+/**
+ * The latest value on a controller lane, -1 if there isn't one.
+ */
+int routeValue(byte lane) {
+  return routeState[lane].value;
+}
+
+/**
+ * Change one setting of a controller route (ROUTE_PARAM_*), for setting
+ * up from outside. It takes effect from the next reading. Returns false,
+ * changing nothing, if the lane, the setting or the value is out of
+ * range. Only the slide lane uses the slide curve.
+ */
+boolean setRouteParam(byte lane, byte param, byte value) {
+  if (lane >= CC_LANES || param >= ROUTE_PARAMS) {
+    return false;
+  }
+  return setConfigParam(CONFIG_ROUTE + lane * ROUTE_CONFIG_PARAMS + param, value);
+}
+
+/**
+ * Load the settings saved in EEPROM, in one read. If there aren't any,
+ * or they're from another CONFIG_VERSION or don't check out, use the
+ * defaults.
+ */
+void loadConfig() {
+  StoredConfig stored;
+  eeprom_read_block(&stored, (const void *) CONFIG_EEPROM_ADDR, sizeof(stored));
+  
+  unsigned int crc = 0xffff;
+  for (byte i = 0; i < sizeof(stored) - sizeof(stored.crc); i++) {
+    crc = _crc16_update(crc, ((byte *) &stored)[i]);
+  }
+  if (stored.version == CONFIG_VERSION && stored.crc == crc && configValid(&stored.config)) {
+    config = stored.config;
+  } else {
+    memcpy_P(&config, &CONFIG_DEFAULTS, sizeof(config));
+  }
+  setChordSettleTicks();
+}
+
+/**
+ * The value of one parameter (see configParams) in a set of settings.
+ */
+unsigned int configValue(const Config *c, byte param) {
+  const byte *field = (const byte *) c + pgm_read_byte(&configParams[param].offset);
+  if (pgm_read_byte(&configParams[param].size) == 2) {
+    return field[0] | (field[1] << 8);
+  }
+  return field[0];
+}
+
+/**
+ * True if every parameter in a set of settings is in range.
+ */
+boolean configValid(const Config *c) {
+  for (byte param = 0; param < CONFIG_PARAMS; param++) {
+    unsigned int value = configValue(c, param);
+    if (value < pgm_read_word(&configParams[param].low) || value > pgm_read_word(&configParams[param].high)) {
+      return false;
     }
   }
+  return true;
+}
+
+/**
+ * Change one parameter of the live settings. Returns false, changing
+ * nothing, if there's no such parameter or the value is out of its range.
+ */
+boolean setConfigParam(byte param, unsigned int value) {
+  if (param >= CONFIG_PARAMS ||
+      value < pgm_read_word(&configParams[param].low) || value > pgm_read_word(&configParams[param].high)) {
+    return false;
+  }
+  byte *field = (byte *) &config + pgm_read_byte(&configParams[param].offset);
+  field[0] = value & 0xff;
+  if (pgm_read_byte(&configParams[param].size) == 2) {
+    field[1] = value >> 8;
+  }
+  configChanged();
+  return true;
+}
+
+/**
+ * Bring what's worked out from the settings up to date after they
+ * change. A save in progress starts again, so it doesn't store half of
+ * the old settings and half of the new.
+ */
+void configChanged() {
+  setBreathLevels();
+  setChordSettleTicks();
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    routeState[lane].countdown = 1;
+  }
+  slideQuantPosition = -1;
+  if (configSaveNext < sizeof(StoredConfig)) {
+    saveConfig();
+  }
+}
+
+/**
+ * Start saving the live settings to EEPROM. saveConfigStep() does the
+ * writing, as the EEPROM is free.
+ */
+void saveConfig() {
+  unsigned int crc = _crc16_update(0xffff, CONFIG_VERSION);
+  for (byte i = 0; i < sizeof(Config); i++) {
+    crc = _crc16_update(crc, ((byte *) &config)[i]);
+  }
+  configSaveCrc = crc;
+  configSaveNext = 0;
 }
 
-void sendXYControllers(int x, int y, byte chan, boolean debug) {
-  int mappedXValue = map(x, 0, 1024, 0, 127);
-  int mappedYValue = map(y, 0, 1024, 0, 127);
-  if (abs(currentXValue - mappedXValue) > VOLUME_SEND_THRESHOLD) {
-    currentXValue = mappedXValue;
-    if (debug) {
-      Serial.print("X ");
-      Serial.print(mappedXValue);
+/**
+ * Carry on with a save: skip the bytes of StoredConfig the EEPROM
+ * already holds and start writing the next one that differs, unless the
+ * last write (3.3 ms a byte) is still going. Called every pass.
+ */
+void saveConfigStep() {
+  while (configSaveNext < sizeof(StoredConfig) && eeprom_is_ready()) {
+    byte b;
+    if (0 == configSaveNext) {
+      b = CONFIG_VERSION;
+    } else if (configSaveNext <= sizeof(Config)) {
+      b = ((byte *) &config)[configSaveNext - 1];
     } else {
-      MidiUart.sendCC(chan, X_CC, mappedXValue);
+      b = configSaveNext == sizeof(Config) + 1 ? configSaveCrc & 0xff : configSaveCrc >> 8;
+    }
+    byte *addr = (byte *) CONFIG_EEPROM_ADDR + configSaveNext++;
+    if (eeprom_read_byte(addr) != b) {
+      eeprom_write_byte(addr, b);
+    }
+  }
+}
+
+/**
+ * Take one SYSEX_CONFIG_DATA message in, F0 through F7. Chunks have to
+ * come in order from offset 0; the settings change once the last one is
+ * in and they all check out. Returns false, for anything that isn't a
+ * well-formed chunk.
+ */
+boolean loadConfigChunk(const byte *data, byte length) {
+  if (length < 10) {
+    return false;
+  }
+  byte offset = data[4];
+  byte count = data[5];
+  if (length != 8 + 2 * count || 0 == count || count > CONFIG_CHUNK || offset + count > sizeof(Config)) {
+    return false;
+  }
+  byte check = 0;
+  for (byte i = 3; i < length - 2; i++) {
+    check ^= data[i];
+  }
+  if (check != data[length - 2]) {
+    return false;
+  }
+  if (data[3] != CONFIG_VERSION || (0 != offset && offset != configLoadNext)) {
+    configLoadNext = sizeof(Config);
+    return true;
+  }
+  for (byte i = 0; i < count; i++) {
+    ((byte *) &configLoad)[offset + i] = ((data[6 + 2 * i] & 0x0f) << 4) | (data[7 + 2 * i] & 0x0f);
+  }
+  configLoadNext = offset + count;
+  if (configLoadNext == sizeof(Config) && configValid(&configLoad)) {
+    config = configLoad;
+    configChanged();
+  }
+  return true;
+}
+
+/**
+ * Send a pending SYSEX_CONFIG_VALUE, or the next chunk of a settings
+ * dump, as the bulk lane frees up. Call every pass; start a dump by
+ * setting configDumpNext to 0.
+ */
+void dumpConfig() {
+  byte msg[8 + 2 * CONFIG_CHUNK];
+  byte len = 0;
+  msg[len++] = MIDI_SYSEX_START;
+  msg[len++] = SYSEX_ID;
+  if (-1 != configReplyParam) {
+    unsigned int value = configValue(&config, configReplyParam);
+    msg[len++] = SYSEX_CONFIG_VALUE;
+    msg[len++] = configReplyParam;
+    msg[len++] = (value >> 14) & 0x7f;
+    msg[len++] = (value >> 7) & 0x7f;
+    msg[len++] = value & 0x7f;
+    msg[len++] = MIDI_SYSEX_END;
+    if (transportSysex(msg, len)) {
+      configReplyParam = -1;
+    }
+    return;
+  }
+  if (configDumpNext >= sizeof(Config)) {
+    return;
+  }
+  byte count = sizeof(Config) - configDumpNext;
+  if (count > CONFIG_CHUNK) {
+    count = CONFIG_CHUNK;
+  }
+  msg[len++] = SYSEX_CONFIG_DATA;
+  msg[len++] = CONFIG_VERSION;
+  msg[len++] = configDumpNext;
+  msg[len++] = count;
+  for (byte i = 0; i < count; i++) {
+    byte b = ((byte *) &config)[configDumpNext + i];
+    msg[len++] = b >> 4;
+    msg[len++] = b & 0x0f;
+  }
+  byte check = 0;
+  for (byte i = 3; i < len; i++) {
+    check ^= msg[i];
+  }
+  msg[len++] = check;
+  msg[len++] = MIDI_SYSEX_END;
+  if (transportSysex(msg, len)) {
+    configDumpNext += count;
+  }
+}
+
+/**
+ * Run the breath onset detector on every breath sample that has come in
+ * since it last ran, oldest first: the ones in the ring newer than
+ * onsetLastTime, or the whole ring if it has gone all the way round.
+ * Called every tick, so it keeps up with the ADC whatever VOLUME_PERIOD
+ * is. Opens breathGate, with onsetVelocity and onsetTime set, when an
+ * attack is confirmed, and closes it when the breath stops.
+ */
+void updateBreathOnset() {
+  int samples[ADC_RING_SIZE];
+  unsigned int times[ADC_RING_SIZE];
+  byte count = 0;
+  uint8_t oldSREG = SREG;
+  cli();
+  byte idx = adcHead[ADC_BREATH];
+  while (count < ADC_RING_SIZE && adcTime[ADC_BREATH][idx] != onsetLastTime) {
+    samples[count] = adcRing[ADC_BREATH][idx];
+    times[count] = adcTime[ADC_BREATH][idx];
+    count++;
+    idx = (idx - 1) & (ADC_RING_SIZE - 1);
+  }
+  SREG = oldSREG;
+  while (count > 0) {
+    count--;
+    breathOnsetSample(samples[count], times[count]);
+  }
+}
+
+/**
+ * Feed one breath sample, taken at time, to the onset detector.
+ */
+void breathOnsetSample(int sample, unsigned int time) {
+  unsigned int elapsed = time - onsetLastTime;
+  int slope = 0;
+  if (sample > onsetLastSample && elapsed < 0x8000) {
+    slope = constrain((long) (sample - onsetLastSample) * 1000L / elapsed, 0, 0x7fff);
+  }
+  onsetLastSample = sample;
+  onsetLastTime = time;
+  
+  if (breathZeroing()) {
+    zeroBreathSample(sample);
+    onsetState = ONSET_IDLE;
+    breathGate = false;
+    return;
+  }
+  
+  switch (onsetState) {
+    case ONSET_IDLE:
+      if (sample < breathOnsetLevel) {
+        // Nothing coming in: follow the resting level
+        breathFloor += (((long) sample << BREATH_FLOOR_FRAC_BITS) - breathFloor) >> BREATH_DRIFT_SHIFT;
+        setBreathLevels();
+        break;
+      }
+      onsetState = ONSET_ATTACK;
+      onsetSamples = 0;
+      onsetPeakSlope = 0;
+      // Fall through: this sample is the first of the attack
+    case ONSET_ATTACK:
+      if (sample < breathReleaseLevel) {
+        onsetState = ONSET_IDLE;
+        break;
+      }
+      if (slope > onsetPeakSlope) {
+        onsetPeakSlope = slope;
+      }
+      if (++onsetSamples >= config.onsetConfirmSamples || sample >= breathConfirmLevel) {
+        long velocity = config.onsetMinVelocity +
+          (long) onsetPeakSlope * (127 - config.onsetMinVelocity) / config.onsetFullSlope;
+        onsetVelocity = constrain(velocity, 1, 127);
+        onsetTime = time;
+        onsetState = ONSET_SOUNDING;
+        breathGate = true;
+      }
+      break;
+    case ONSET_SOUNDING:
+      if (sample < breathReleaseLevel) {
+        onsetState = ONSET_IDLE;
+        breathGate = false;
+      }
+      break;
+  }
+}
+
+/**
+ * Start measuring the breath sensor's resting level. The onset detector
+ * takes the next BREATH_ZERO_SAMPLES samples for it, and holds the
+ * breath gate shut until it's done.
+ */
+void startBreathZero() {
+  breathZeroCount = 0;
+  breathZeroSum = 0;
+  breathZeroMin = 1023;
+  breathZeroMax = 0;
+}
+
+boolean breathZeroing() {
+  return breathZeroCount < BREATH_ZERO_SAMPLES;
+}
+
+/**
+ * Take one sample towards the resting level. With the last one in, use
+ * the result if it's believable.
+ */
+void zeroBreathSample(int sample) {
+  breathZeroSum += sample;
+  if (sample < breathZeroMin) {
+    breathZeroMin = sample;
+  }
+  if (sample > breathZeroMax) {
+    breathZeroMax = sample;
+  }
+  if (++breathZeroCount < BREATH_ZERO_SAMPLES) {
+    return;
+  }
+  int rest = breathZeroSum / BREATH_ZERO_SAMPLES;
+  int noise = breathZeroMax - breathZeroMin;
+  if (rest > BREATH_ZERO_MAX_REST || noise > BREATH_ZERO_MAX_NOISE) {
+    return;
+  }
+  breathFloor = (breathZeroSum << BREATH_FLOOR_FRAC_BITS) / BREATH_ZERO_SAMPLES;
+  breathNoise = noise;
+  setBreathLevels();
+  debugRecord(DBG_BREATH_ZERO, noise, rest);
+}
+
+/**
+ * Set the onset, release and confirm levels and the breath table offset
+ * from the resting level and noise.
+ */
+void setBreathLevels() {
+  int rest = (breathFloor + (1L << (BREATH_FLOOR_FRAC_BITS - 1))) >> BREATH_FLOOR_FRAC_BITS;
+  int margin = breathNoise * config.onsetNoiseFactor;
+  if (margin < config.onsetMarginMin) {
+    margin = config.onsetMarginMin;
+  }
+  breathOnsetLevel = rest + margin;
+  breathReleaseLevel = breathOnsetLevel -
+    (breathNoise > config.releaseHysteresisMin ? breathNoise : config.releaseHysteresisMin);
+  breathConfirmLevel = rest + (config.onsetConfirmMargin > margin ? config.onsetConfirmMargin : margin);
+  breathTableOffset = breathOnsetLevel - NOTE_ON_VOLUME_THRESHOLD;
+  
+  uint8_t oldSREG = SREG;
+  cli();
+  idleWakeLevel = breathOnsetLevel;
+  SREG = oldSREG;
+}
+
+/**
+ * Queue a note event (or anything else that must not be dropped or
+ * replaced) behind any note events already waiting. If the lane is full,
+ * wait for the transmitter to make room.
+ */
+void midiQueueNote(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  if (uartMode != UART_MIDI) {
+    return;
+  }
+  noteQueuePut(status, data1, data2, sampleTime);
+  noteLaneTokens += MESSAGE_TOKENS;
+}
+
+/**
+ * Put a message on the note lane, waiting for room if it's full. The
+ * caller charges its link time to whichever bucket it belongs to.
+ */
+void noteQueuePut(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  byte tail = noteQueueTail;
+  byte next = (tail + 1) & (NOTE_QUEUE_SIZE - 1);
+  while (next == noteQueueHead) {
+    // Lane full; the UART interrupt is draining it
+    WAIT_FOR_INTERRUPT();
+  }
+  noteQueue[tail].status = status;
+  noteQueue[tail].data1 = data1;
+  noteQueue[tail].data2 = data2;
+  noteQueue[tail].sampleTime = sampleTime;
+  noteQueue[tail].queueTime = micros();
+  noteQueueTail = next;
+  MIDI_UCSRB |= _BV(MIDI_UDRIE);
+}
+
+/**
+ * Queue a controller value. If the same controller is still waiting to
+ * go out, its value is replaced. Pitch bend is identified by status
+ * alone, since both of its data bytes are the value.
+ */
+void midiQueueController(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  if (uartMode != UART_MIDI) {
+    return;
+  }
+  boolean isPitchBend = (status & 0xf0) == MIDI_PITCH_BEND;
+  byte slot;
+  for (slot = 0; slot < ccSlotCount; slot++) {
+    if (ccSlots[slot].status == status && (isPitchBend || ccSlots[slot].data1 == data1)) {
+      break;
     }
   }
-  if (abs(currentYValue - mappedYValue) > VOLUME_SEND_THRESHOLD) {
-    currentYValue = mappedYValue;
-    if (debug) {
-      Serial.print("Y ");
-      Serial.print(mappedYValue);
+  if (slot == CC_SLOTS) {
+    return; // No free slot; drop it, a newer value will follow
+  }
+  
+  uint8_t oldSREG = SREG;
+  cli();
+  if (slot == ccSlotCount) {
+    ccSlotCount++;
+  }
+  ccSlots[slot].status = status;
+  ccSlots[slot].data1 = data1;
+  ccSlots[slot].data2 = data2;
+  ccSlots[slot].sampleTime = sampleTime;
+  ccSlots[slot].queueTime = micros();
+  ccPending |= 1 << slot;
+  MIDI_UCSRB |= _BV(MIDI_UDRIE);
+  SREG = oldSREG;
+}
+
+/**
+ * Queue a controller value through the note lane, in order with the
+ * notes around it, dropping any older value of it still waiting in its
+ * slot. controllerMaySend() has already taken its link time from the
+ * controller's bucket, so it isn't charged to the note lane as well.
+ */
+void midiQueueControllerInOrder(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  if (uartMode != UART_MIDI) {
+    return;
+  }
+  boolean isPitchBend = (status & 0xf0) == MIDI_PITCH_BEND;
+  uint8_t oldSREG = SREG;
+  cli();
+  for (byte slot = 0; slot < ccSlotCount; slot++) {
+    if (ccSlots[slot].status == status && (isPitchBend || ccSlots[slot].data1 == data1)) {
+      ccPending &= ~(1 << slot);
+      ccRound &= ~(1 << slot);
+      break;
+    }
+  }
+  SREG = oldSREG;
+  noteQueuePut(status, data1, data2, sampleTime);
+}
+
+/**
+ * Queue a complete SysEx message (F0 through F7) on the bulk lane.
+ * Return false, without queueing it, if the lane is still busy with the
+ * last one.
+ */
+boolean midiQueueSysex(const byte *data, byte length) {
+  if (sysexLength || uartMode != UART_MIDI) {
+    return false;
+  }
+  memcpy(sysexBuffer, data, length);
+  sysexLength = length;
+  MIDI_UCSRB |= _BV(MIDI_UDRIE);
+  noteLaneTokens += length * TOKENS_PER_BYTE;
+  return true;
+}
+
+/**
+ * Queue a message that came in on MIDI in, behind our own note events.
+ * If the lane is full, the message is dropped and counted in
+ * midiInDropped: waiting for room would hold up the control loop for
+ * as long as the chain upstream keeps sending faster than we can.
+ */
+void midiQueueThru(byte status, byte data1, byte data2) {
+  if (uartMode != UART_MIDI) {
+    return;
+  }
+  byte tail = thruQueueTail;
+  byte next = (tail + 1) & (THRU_QUEUE_SIZE - 1);
+  if (next == thruQueueHead) {
+    midiInDrop();
+    return;
+  }
+  thruQueue[tail].status = status;
+  thruQueue[tail].data1 = data1;
+  thruQueue[tail].data2 = data2;
+  thruQueueTail = next;
+  MIDI_UCSRB |= _BV(MIDI_UDRIE);
+  noteLaneTokens += (1 + midiDataLength(status)) * TOKENS_PER_BYTE;
+}
+
+/**
+ * Number of data bytes that follow a channel or system common status.
+ */
+byte midiDataLength(byte status) {
+  switch (status & 0xf0) {
+    case 0xc0:
+    case 0xd0:
+      return 1;
+    case 0xf0:
+      return (status == 0xf1 || status == 0xf3) ? 1 : (status == 0xf2) ? 2 : 0;
+    default:
+      return 2;
+  }
+}
+
+/**
+ * Set the DIN port up for MIDI: 31250 baud, 8N1, with the receive
+ * interrupt on. The sketch drives the UART itself, on whichever USART
+ * the board profile picks.
+ */
+void midiPortInit() {
+  MIDI_UBRR = F_CPU / 16 / MIDI_BAUD - 1;
+  MIDI_UCSRA = 0;
+  MIDI_UCSRC = _BV(MIDI_UCSZ1) | _BV(MIDI_UCSZ0);
+  MIDI_UCSRB = _BV(MIDI_TXEN) | _BV(MIDI_RXEN) | _BV(MIDI_RXCIE);
+}
+
+/**
+ * A byte has come in on MIDI in. Realtime bytes go straight to the
+ * transmitter; the rest wait in the ring for readMidiIn(). Input is
+ * ignored while the UART isn't carrying MIDI.
+ */
+ISR(MIDI_RX_vect) {
+  boolean bad = MIDI_UCSRA & (_BV(MIDI_FE) | _BV(MIDI_DOR));
+  byte b = MIDI_UDR;
+  if (uartMode != UART_MIDI) {
+    return;
+  }
+  if (bad) {
+    midiInDropped++;
+  }
+  if (b >= MIDI_REALTIME) {
+    byte next = (realtimeTail + 1) & (REALTIME_QUEUE_SIZE - 1);
+    if (next == realtimeHead) {
+      midiInDropped++;
+      return;
+    }
+    realtimeQueue[realtimeTail] = b;
+    realtimeTail = next;
+    MIDI_UCSRB |= _BV(MIDI_UDRIE);
+    return;
+  }
+  byte next = (midiInHead + 1) & (MIDI_IN_BUFFER_SIZE - 1);
+  if (next == midiInTail) {
+    midiInDropped++;
+    return;
+  }
+  midiInBuffer[midiInHead] = b;
+  midiInHead = next;
+  if (idle) {
+    wakeFromIdle();
+  }
+}
+
+/**
+ * Parse everything that has come in on MIDI in since the last pass.
+ */
+void readMidiIn() {
+  while (midiInTail != midiInHead) {
+    byte b = midiInBuffer[midiInTail];
+    midiInTail = (midiInTail + 1) & (MIDI_IN_BUFFER_SIZE - 1);
+    parseMidiIn(b);
+    lastActiveTick = controlTicks;
+  }
+}
+
+/**
+ * Take one byte of MIDI in, following running status. A SysEx is
+ * gathered whole; one that's too long to keep, or is cut short by
+ * another status byte, is dropped.
+ */
+void parseMidiIn(byte b) {
+  if (midiInSysex) {
+    if (!(b & 0x80) || b == MIDI_SYSEX_END) {
+      if (midiInSysexLength < SYSEX_BUFFER_SIZE) {
+        midiInSysexBuffer[midiInSysexLength] = b;
+      }
+      if (midiInSysexLength <= SYSEX_BUFFER_SIZE) {
+        midiInSysexLength++;
+      }
+      if (b != MIDI_SYSEX_END) {
+        return;
+      }
+      midiInSysex = false;
+      if (midiInSysexLength <= SYSEX_BUFFER_SIZE) {
+        handleSysexIn(midiInSysexBuffer, midiInSysexLength);
+      } else {
+        midiInDrop();
+      }
+      return;
+    }
+    midiInSysex = false;
+    midiInDrop();
+  }
+  if (b == MIDI_SYSEX_START) {
+    midiInSysex = true;
+    midiInSysexBuffer[0] = b;
+    midiInSysexLength = 1;
+    midiInStatus = 0;
+    return;
+  }
+  if (b & 0x80) {
+    midiInCount = 0;
+    midiInStatus = b;
+    if (0 == midiDataLength(b)) {
+      if (0xF6 == b) {
+        handleMidiIn(b, 0, 0);  // Tune request; F4, F5 and a stray F7 mean nothing
+      }
+      midiInStatus = 0;
+    }
+    return;
+  }
+  if (0 == midiInStatus) {
+    return;  // Data without a status to go with it
+  }
+  midiInData[midiInCount++] = b;
+  if (midiInCount < midiDataLength(midiInStatus)) {
+    return;
+  }
+  midiInCount = 0;
+  handleMidiIn(midiInStatus, midiInData[0], midiInData[1]);
+  if (midiInStatus >= MIDI_SYSEX_START) {
+    midiInStatus = 0;  // System common messages have no running status
+  }
+}
+
+/**
+ * A complete message from MIDI in: run it if it's for us, otherwise
+ * send it on.
+ */
+void handleMidiIn(byte status, byte data1, byte data2) {
+  if ((MIDI_CONTROL_CHANGE | META_CHANNEL) == status) {
+    if (data1 >= META_CC_BASE && data1 < META_CC_BASE + 16) {
+      if (data2 >= 64) {
+        sendMetaCommand(META_CHANNEL, data1 - META_CC_BASE);
+      }
+      return;
+    }
+    if (data1 >= SYSTEM_CC_BASE && data1 < SYSTEM_CC_BASE + 16) {
+      if (data2 >= 64) {
+        runSystemCommand(data1 - SYSTEM_CC_BASE);
+      }
+      return;
+    }
+  }
+  midiQueueThru(status, data1, data2);
+}
+
+/**
+ * A complete SysEx from MIDI in, F0 through F7: run it if it's one of
+ * ours, otherwise send it on, if the bulk lane is free.
+ */
+void handleSysexIn(const byte *data, byte length) {
+  if (length >= 4 && SYSEX_ID == data[1]) {
+    switch (data[2]) {
+      case SYSEX_META:
+        if (5 == length && data[3] < 16) {
+          sendMetaCommand(META_CHANNEL, data[3]);
+          return;
+        }
+        break;
+      case SYSEX_SYSTEM:
+        if (5 == length) {
+          runSystemCommand(data[3]);
+          return;
+        }
+        break;
+      case SYSEX_ROUTE:
+        if (7 == length) {
+          setRouteParam(data[3], data[4], data[5]);
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_GET:
+        if (5 == length && data[3] < CONFIG_PARAMS) {
+          configReplyParam = data[3];
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_SET:
+        if (8 == length && data[3] < CONFIG_PARAMS) {
+          long value = (long) data[4] << 14 | data[5] << 7 | data[6];
+          if (value <= 0xffff) {
+            setConfigParam(data[3], value);
+          }
+          configReplyParam = data[3];
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_DUMP:
+        if (4 == length) {
+          configDumpNext = 0;
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_DATA:
+        if (loadConfigChunk(data, length)) {
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_SAVE:
+        if (4 == length) {
+          saveConfig();
+          return;
+        }
+        break;
+      case SYSEX_CONFIG_DEFAULTS:
+        if (4 == length) {
+          memcpy_P(&config, &CONFIG_DEFAULTS, sizeof(config));
+          configChanged();
+          return;
+        }
+        break;
+    }
+  }
+  if (!midiQueueSysex(data, length)) {
+    midiInDrop();
+  }
+}
+
+/**
+ * Count a message from MIDI in that was lost, outside the receive
+ * interrupt, which counts in midiInDropped too.
+ */
+void midiInDrop() {
+  uint8_t oldSREG = SREG;
+  cli();
+  midiInDropped++;
+  SREG = oldSREG;
+}
+
+/**
+ * Forget any message half received, and anything waiting to go through.
+ */
+void resetMidiIn() {
+  uint8_t oldSREG = SREG;
+  cli();
+  midiInTail = midiInHead;
+  realtimeHead = realtimeTail;
+  SREG = oldSREG;
+  midiInStatus = 0;
+  midiInCount = 0;
+  midiInSysex = false;
+}
+
+DinTransport::DinTransport() {
+  sent[CC_LANE_PB] = PITCH_BEND_NEUTRAL;
+  sent[CC_LANE_BREATH] = 0;
+  sent[CC_LANE_X] = 0;
+  sent[CC_LANE_Y] = 0;
+}
+
+void DinTransport::note(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  midiQueueNote(status, data1, data2, sampleTime);
+}
+
+/**
+ * Send a controller if its lane has the link time for it. The debug
+ * record goes with it, so debug mode shows what the wire would carry;
+ * the DBG_ types for controllers are in lane order from DBG_PITCH_BEND.
+ */
+void DinTransport::controller(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                              unsigned int sampleTime) {
+  if (controllerMaySend(lane, value, sent[lane], urgent)) {
+    sent[lane] = value;
+    debugRecord(DBG_PITCH_BEND + lane, status & 0x0f, value);
+    if (urgent) {
+      midiQueueControllerInOrder(status, data1, data2, sampleTime);
     } else {
-      MidiUart.sendCC(chan, Y_CC, mappedYValue);
+      midiQueueController(status, data1, data2, sampleTime);
     }
   }
 }
 
+boolean DinTransport::sysexReady() {
+  return !sysexLength;
+}
+
+void DinTransport::sysex(const byte *data, byte length) {
+  midiQueueSysex(data, length);
+}
+
+#if USB_MIDI
+UsbMidiTransport::UsbMidiTransport() {
+  length = 0;
+  sent[CC_LANE_PB] = PITCH_BEND_NEUTRAL;
+  sent[CC_LANE_BREATH] = 0;
+  sent[CC_LANE_X] = 0;
+  sent[CC_LANE_Y] = 0;
+}
+
+/**
+ * Add one event to the packet, sending the packet first if it's full.
+ */
+void UsbMidiTransport::put(byte cin, byte b0, byte b1, byte b2) {
+  if (length == USB_PACKET_SIZE) {
+    flush();
+  }
+  packet[length++] = cin; // Cable 0
+  packet[length++] = b0;
+  packet[length++] = b1;
+  packet[length++] = b2;
+}
+
+void UsbMidiTransport::note(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  put(status >> 4, status, data1, data2);
+}
+
+void UsbMidiTransport::controller(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                                  unsigned int sampleTime) {
+  if (value != sent[lane]) {
+    sent[lane] = value;
+    put(status >> 4, status, data1, data2);
+  }
+}
+
+/**
+ * Split a SysEx into events of three bytes, the last one carrying
+ * whatever is left over.
+ */
+void UsbMidiTransport::sysex(const byte *data, byte length) {
+  while (length > 3) {
+    put(USB_CIN_SYSEX, data[0], data[1], data[2]);
+    data += 3;
+    length -= 3;
+  }
+  put(USB_CIN_SYSEX_END + length, data[0], length > 1 ? data[1] : 0, length > 2 ? data[2] : 0);
+}
+
+void UsbMidiTransport::flush() {
+  if (length) {
+    MidiUSB.write(packet, length);
+    MidiUSB.flush();
+    length = 0;
+  }
+}
+#endif
+
+void transportNote(byte status, byte data1, byte data2, unsigned int sampleTime) {
+  for (byte i = 0; i < TRANSPORTS; i++) {
+    transports[i]->note(status, data1, data2, sampleTime);
+  }
+}
+
+/**
+ * Offer a controller reading to every transport. value is the reading
+ * as a number, for comparing with what was sent before.
+ */
+void transportController(byte lane, byte status, byte data1, byte data2, int value, boolean urgent,
+                         unsigned int sampleTime) {
+  for (byte i = 0; i < TRANSPORTS; i++) {
+    transports[i]->controller(lane, status, data1, data2, value, urgent, sampleTime);
+  }
+}
+
+/**
+ * Send a SysEx on every transport, if every one of them can take it
+ * now. Return false if it wasn't sent, so the caller can try again.
+ */
+boolean transportSysex(const byte *data, byte length) {
+  for (byte i = 0; i < TRANSPORTS; i++) {
+    if (!transports[i]->sysexReady()) {
+      return false;
+    }
+  }
+  for (byte i = 0; i < TRANSPORTS; i++) {
+    transports[i]->sysex(data, length);
+  }
+  return true;
+}
+
+void transportFlush() {
+  for (byte i = 0; i < TRANSPORTS; i++) {
+    transports[i]->flush();
+  }
+}
+
+/**
+ * Load the next message to transmit: the oldest note event if there is
+ * one, otherwise a waiting controller, otherwise a waiting SysEx. Return
+ * false if nothing is waiting. Called from the UART interrupt.
+ *
+ * Controllers are sent in rounds: every slot waiting when a round starts
+ * goes out before anything that became ready later. Within a round, slots
+ * that share the running status go first to make the runs longer.
+ */
+boolean midiTxNext() {
+  if (txSysex) {
+    // The SysEx just finished; free the bulk lane
+    txSysex = false;
+    sysexLength = 0;
+  }
+  txThru = false;
+  
+  MidiMessage *msg;
+  if (noteQueueHead != noteQueueTail) {
+    msg = &noteQueue[noteQueueHead];
+    noteQueueHead = (noteQueueHead + 1) & (NOTE_QUEUE_SIZE - 1);
+  } else if (thruQueueHead != thruQueueTail) {
+    msg = &thruQueue[thruQueueHead];
+    thruQueueHead = (thruQueueHead + 1) & (THRU_QUEUE_SIZE - 1);
+    txThru = true;
+  } else if (ccPending) {
+    if (0 == ccRound) {
+      ccRound = ccPending;
+    }
+    byte slot = CC_SLOTS;
+    for (byte i = 0; i < ccSlotCount; i++) {
+      if ((ccRound & (1 << i)) && ccSlots[i].status == runningStatus) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot == CC_SLOTS) {
+      for (slot = 0; !(ccRound & (1 << slot)); slot++) {
+      }
+    }
+    ccRound &= ~(1 << slot);
+    ccPending &= ~(1 << slot);
+    msg = &ccSlots[slot];
+  } else if (sysexLength) {
+    txSysex = true;
+    txData = sysexBuffer;
+    txLength = sysexLength;
+    txIndex = 0;
+    txStatus = MIDI_SYSEX_START;
+    runningStatus = 0;  // SysEx cancels running status
+    return true;
+  } else {
+    return false;
+  }
+  
+  byte status = msg->status;
+  if ((status & 0xf0) == MIDI_NOTE_OFF && 0 == msg->data2) {
+    // Note On with velocity 0 means the same thing, and shares running
+    // status with the Note Ons around it
+    status = MIDI_NOTE_ON | (status & 0x0f);
+  }
+  txMessage[0] = status;
+  txMessage[1] = msg->data1;
+  txMessage[2] = msg->data2;
+  txData = txMessage;
+  txLength = 1 + midiDataLength(status);
+  txStatus = status;
+  txSampleTime = msg->sampleTime;
+  txQueueTime = msg->queueTime;
+  
+  unsigned long now = millis();
+  if (status >= MIDI_SYSEX_START) {
+    txIndex = 0;
+    runningStatus = 0;  // System common (from MIDI in) cancels running status
+  } else if (status == runningStatus && now - runningStatusTime < RUNNING_STATUS_REFRESH_MS) {
+    txIndex = 1;  // Leave out the status byte
+  } else {
+    txIndex = 0;
+    runningStatus = status;
+    runningStatusTime = now;
+  }
+  return true;
+}
+
+/**
+ * UART ready for another byte. Finish the message in progress, then
+ * start the next one. Messages are never interleaved, but realtime bytes
+ * passing through go out at once, even in the middle of one.
+ */
+ISR(MIDI_UDRE_vect) {
+  if (uartMode != UART_MIDI) {
+    if (recordTail == recordHead) {
+      MIDI_UCSRB &= ~_BV(MIDI_UDRIE);
+      return;
+    }
+    MIDI_UDR = recordBuffer[recordTail];
+    recordTail = (recordTail + 1) & (RECORD_BUFFER_SIZE - 1);
+    return;
+  }
+  if (realtimeHead != realtimeTail) {
+    MIDI_UDR = realtimeQueue[realtimeHead];
+    realtimeHead = (realtimeHead + 1) & (REALTIME_QUEUE_SIZE - 1);
+    return;
+  }
+  if (txIndex == txLength && !midiTxNext()) {
+    MIDI_UCSRB &= ~_BV(MIDI_UDRIE);  // Nothing left to send
+    return;
+  }
+  MIDI_UDR = txData[txIndex++];
+  if (txIndex == txLength && !txSysex && !txThru) {
+    recordLatency(txStatus, txSampleTime, txQueueTime);
+  }
+}
+
+/**
+ * Count a message that has just gone out in the latency histograms.
+ * Called from the UART interrupt.
+ */
+void recordLatency(byte status, unsigned int sampleTime, unsigned int queueTime) {
+  byte cls;
+  switch (status & 0xf0) {
+    case MIDI_NOTE_ON:
+    case MIDI_NOTE_OFF:
+      cls = LAT_NOTE;
+      break;
+    case MIDI_PITCH_BEND:
+      cls = LAT_PITCH_BEND;
+      break;
+    default:
+      cls = LAT_CC;
+      break;
+  }
+  unsigned int now = micros();
+  unsigned int queued = (now - queueTime) >> LAT_BUCKET_SHIFT;
+  unsigned int sampled = (now - sampleTime) >> LAT_BUCKET_SHIFT;
+  if (LAT_PITCH_BEND == cls) {
+    // Keep a running average for the slide predictor
+    pbLatencyUs += ((long) (unsigned int) (now - sampleTime) - pbLatencyUs) >> 3;
+  }
+  unsigned int *bucket = &latencyHistogram[cls][LAT_QUEUED][queued < LAT_BUCKETS ? queued : LAT_BUCKETS - 1];
+  if (*bucket != 0xffff) {
+    (*bucket)++;
+  }
+  bucket = &latencyHistogram[cls][LAT_SAMPLED][sampled < LAT_BUCKETS ? sampled : LAT_BUCKETS - 1];
+  if (*bucket != 0xffff) {
+    (*bucket)++;
+  }
+}
+
+/**
+ * Send the latency histograms, one SysEx per class and measure, as the
+ * bulk lane frees up. Each is F0 7D 01 <class> <measure>, then each
+ * bucket count as three 7-bit bytes (high bits first), then F7. Call
+ * every tick while a dump is in progress; start one by setting
+ * latencyDumpNext to 0.
+ */
+void dumpLatencyHistograms() {
+  if (latencyDumpNext >= LAT_CLASSES * LAT_MEASURES) {
+    return;
+  }
+  byte cls = latencyDumpNext / LAT_MEASURES;
+  byte measure = latencyDumpNext % LAT_MEASURES;
+  
+  if (debugging()) {
+    // One record per bucket, as many as fit each pass
+    while (latencyDumpBucket < LAT_BUCKETS && debugHasRoom(1)) {
+      debugRecord(DBG_LATENCY, latencyDumpNext * LAT_BUCKETS + latencyDumpBucket,
+                  latencyHistogram[cls][measure][latencyDumpBucket]);
+      latencyDumpBucket++;
+    }
+    if (latencyDumpBucket == LAT_BUCKETS) {
+      latencyDumpBucket = 0;
+      latencyDumpNext++;
+    }
+    return;
+  }
+  
+  byte msg[6 + 3 * LAT_BUCKETS];
+  byte len = 0;
+  msg[len++] = MIDI_SYSEX_START;
+  msg[len++] = SYSEX_ID;
+  msg[len++] = SYSEX_LATENCY_DUMP;
+  msg[len++] = cls;
+  msg[len++] = measure;
+  for (byte i = 0; i < LAT_BUCKETS; i++) {
+    unsigned int count = latencyHistogram[cls][measure][i];
+    msg[len++] = count >> 14;
+    msg[len++] = (count >> 7) & 0x7f;
+    msg[len++] = count & 0x7f;
+  }
+  msg[len++] = MIDI_SYSEX_END;
+  if (transportSysex(msg, len)) {
+    latencyDumpNext++;
+  }
+}
+
+void sendNoteOn(int note, int vel, byte chan, unsigned int sampleTime) {
+  PROFILE_BEGIN(PROF_SEND_NOTE);
+  if (chan == PLAY_CHANNEL) {
+    activeNotes[note >> 3] |= 1 << (note & 7);
+  }
+  debugRecord(DBG_NOTE_ON, chan, note);
+  transportNote(MIDI_NOTE_ON | chan, note, vel, sampleTime);
+  PROFILE_END(PROF_SEND_NOTE);
+}
+
+void sendNoteOff(int note, int vel, byte chan, unsigned int sampleTime) {
+  PROFILE_BEGIN(PROF_SEND_NOTE);
+  if (chan == PLAY_CHANNEL) {
+    activeNotes[note >> 3] &= ~(1 << (note & 7));
+  }
+  debugRecord(DBG_NOTE_OFF, chan, note);
+  transportNote(MIDI_NOTE_OFF | chan, note, vel, sampleTime);
+  PROFILE_END(PROF_SEND_NOTE);
+}
+
+/**
+ * Top up the controller buckets for the ticks that have gone by. The link
+ * time note events used comes off the top; what's left is split by share,
+ * and anything that overflows a full bucket goes to the other lanes in
+ * priority order.
+ */
+void refillControllerBuckets(byte ticks) {
+  long refill = LINK_TOKENS_PER_TICK * ticks - noteLaneTokens;
+  if (refill < 0) {
+    noteLaneTokens = -refill;
+    return;
+  }
+  noteLaneTokens = 0;
+  
+  long spare = 0;
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    ccTokens[lane] += (refill * config.routes[lane].share) >> 8;
+    if (ccTokens[lane] > CC_BUCKET_DEPTH) {
+      spare += ccTokens[lane] - CC_BUCKET_DEPTH;
+      ccTokens[lane] = CC_BUCKET_DEPTH;
+    }
+  }
+  for (byte lane = 0; spare && lane < CC_LANES; lane++) {
+    long room = CC_BUCKET_DEPTH - ccTokens[lane];
+    if (room > spare) {
+      room = spare;
+    }
+    ccTokens[lane] += room;
+    spare -= room;
+  }
+}
+
+/**
+ * Follow how a controller lane's value is moving: its smoothed slope,
+ * and whether it has turned around since it last sent. Call once per
+ * new reading of the lane, so a lane read every few ticks isn't seen
+ * standing still in between.
+ */
+void trackControllerMotion(byte lane, int value) {
+  ControllerMotion &motion = ccMotion[lane];
+  int step = constrain(value - motion.lastValue, -1024, 1024);
+  motion.lastValue = value;
+  motion.slope += ((step << SLOPE_FRAC_BITS) - motion.slope) >> 2;
+  signed char direction = step > 0 ? 1 : (step < 0 ? -1 : 0);
+  if (direction) {
+    if (motion.direction && direction != motion.direction) {
+      motion.reversed = true;
+    }
+    motion.direction = direction;
+  }
+}
+
+/**
+ * Decide whether a controller lane should send value, given the value it
+ * last sent and how it has been moving (see trackControllerMotion()), and
+ * if so, charge the lane for it.
+ *
+ * Urgent sends (the controllers that go with a note on) always go out
+ * if the value has moved past the base threshold, even if that puts the
+ * bucket in debt.
+ */
+boolean controllerMaySend(byte lane, int value, int sentValue, boolean urgent) {
+  ControllerMotion &motion = ccMotion[lane];
+  int change = abs(value - sentValue);
+  if (0 == change) {
+    return false;
+  }
+  long tokens = ccTokens[lane];
+  int threshold = config.routes[lane].threshold;
+  unsigned long sinceSent = controlTicks - motion.sentTick;
+  boolean due;
+  if (urgent) {
+    due = change > threshold;
+  } else {
+    if (tokens < MESSAGE_TOKENS) {
+      return false;
+    }
+    // Coarser steps the emptier the bucket gets
+    if (tokens < CC_BUCKET_DEPTH / 2) threshold <<= 1;
+    if (tokens < CC_BUCKET_DEPTH / 4) threshold <<= 1;
+    if (tokens < CC_BUCKET_DEPTH / 8) threshold <<= 1;
+    
+    if (change > threshold) {
+      boolean fast = abs(motion.slope) >= config.routes[lane].fastSlope;
+      due = fast || motion.reversed || sinceSent >= CC_SLOW_SEND_TICKS;
+    } else {
+      due = sinceSent >= CC_KEEPALIVE_TICKS;
+    }
+  }
+  if (!due) {
+    return false;
+  }
+  ccTokens[lane] = tokens - MESSAGE_TOKENS;
+  motion.reversed = false;
+  motion.sentTick = controlTicks;
+  return true;
+}
+
+/**
+ * Offer a value on a controller lane to the transports, as its route
+ * says: pitch bend from the slide lane, otherwise a control change.
+ * A value of -1 sends nothing.
+ */
+void sendController(byte lane, int value, boolean urgent) {
+  if (-1 == value) {
+    return;
+  }
+  const RouteConfig &route = config.routes[lane];
+  unsigned int sampleTime = routeState[lane].sampleTime;
+  if (CC_LANE_PB == lane) {
+    transportController(lane, MIDI_PITCH_BEND | route.channel, value & 0x7f, (value >> 7) & 0x7f, value, urgent,
+                        sampleTime);
+  } else {
+    transportController(lane, MIDI_CONTROL_CHANGE | route.channel, route.cc, value, value, urgent,
+                        sampleTime);
+  }
+}
+
+/**
+ * Offer every controller lane that has a new reading its latest value;
+ * an urgent send offers every lane. The pitch bend carries any legato
+ * bend, as far as the range goes.
+ */
+void sendControllers(boolean urgent) {
+  PROFILE_BEGIN(PROF_SEND_CC);
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    RouteState &state = routeState[lane];
+    if (!state.fresh && !urgent) {
+      continue;  // Nothing new since the lane was last looked at
+    }
+    int value = routeValue(lane);
+    if (CC_LANE_PB == lane && -1 != value) {
+      value = constrain(legatoBend(currentPitch, value), 0, PITCH_BEND_MAX);
+    }
+    if (state.fresh && -1 != value) {
+      trackControllerMotion(lane, value);
+    }
+    state.fresh = false;
+    sendController(lane, value, urgent);
+  }
+  PROFILE_END(PROF_SEND_CC);
+}
+
+/**
+ * Panic: turn off every note we have sounding, then send All Notes Off
+ * and All Sound Off in case the synth is hanging on to something else.
+ * Only the notes actually on get a Note Off, so this takes a few
+ * milliseconds of wire time rather than 128 messages.
+ */
 void allNotesOff() {
-  for (int i = 0; i < 128; i++) {
-    sendNoteOff(i, 0, 1, DEBUG);
+  unsigned int now = micros();
+  for (int i = 0; i < 128; i += 8) {
+    byte bits = activeNotes[i >> 3];
+    for (int n = i; bits; n++, bits >>= 1) {
+      if (bits & 1) {
+        sendNoteOff(n, 0, PLAY_CHANNEL, now);
+      }
+    }
   }
+  debugRecord(DBG_PANIC, PLAY_CHANNEL, 0);
+  transportNote(MIDI_CONTROL_CHANGE | PLAY_CHANNEL, MIDI_ALL_NOTES_OFF_CC, 0, now);
+  transportNote(MIDI_CONTROL_CHANGE | PLAY_CHANNEL, MIDI_ALL_SOUND_OFF_CC, 0, now);
+  currentNote = -1;
+  currentPitch = -1;
+}
+
+/**
+ * Return the pitch bend that makes the sounding note play pitch with the
+ * slide at pitchBend. It can be outside 0 - PITCH_BEND_MAX, which means
+ * the bend can't reach. Returns -1 if the slide isn't being touched.
+ */
+long legatoBend(int pitch, int pitchBend) {
+  if (-1 == pitchBend) {
+    return -1;
+  }
+  return pitchBend + (long) (pitch - currentNote) * PB_PER_SEMITONE;
+}
+
+/**
+ * Move the sounding note to newNote, as the legato mode says. The
+ * timestamp is the sample behind the change.
+ */
+void changeNote(int newNote, unsigned int sampleTime) {
+  int pb = routeValue(CC_LANE_PB);
+  if (LEGATO_OFF == config.legatoMode) {
+    sendNoteOff(currentNote, 0, PLAY_CHANNEL, sampleTime);
+    currentNote = newNote;
+    currentPitch = newNote;
+    sendControllers(true);
+    sendNoteOn(newNote, onsetVelocity, PLAY_CHANNEL, sampleTime);
+    return;
+  }
+  
+  // The bend with no legato offset, from where the slide last was if it
+  // has been let go
+  int plainBend = -1 == pb ? slideBend : pb;
+  if (newNote == currentNote) {
+    // Back to the note that's sounding: just take any legato bend off
+    currentPitch = newNote;
+    sendController(CC_LANE_PB, plainBend, true);
+    return;
+  }
+  
+  long bend = legatoBend(newNote, pb);
+  if (LEGATO_BEND == config.legatoMode && bend >= 0 && bend <= PITCH_BEND_MAX) {
+    currentPitch = newNote;
+    sendController(CC_LANE_PB, bend, true);
+    return;
+  }
+  sendController(CC_LANE_PB, plainBend, true);
+  sendNoteOn(newNote, onsetVelocity, PLAY_CHANNEL, sampleTime);
+  sendNoteOff(currentNote, 0, PLAY_CHANNEL, sampleTime);
+  currentNote = newNote;
+  currentPitch = newNote;
 }
 
 /*
  Send whatever meta mode command.
  */
-int sendMetaCommand(byte chan, unsigned char value) {
-  if (DEBUG) {
-      Serial.print("META ");
-      Serial.println(metaValue, HEX);
-    } else {
-      //MidiUart.sendCC(chan, 20 + value, 1);
-      MidiUart.sendNoteOn(chan, value, 127);
+void sendMetaCommand(byte chan, unsigned char value) {
+  debugRecord(DBG_META, chan, value);
+  transportNote(MIDI_NOTE_ON | chan, value, 127, micros());
+}
+
+#if LOOP_PROFILER
+/**
+ * Run Timer1 straight off the CPU clock, so TCNT1 counts cycles. It
+ * wraps every 4 ms, which is far longer than any stage. This takes
+ * Timer1 away from analogWrite() on pins 9 and 10.
+ */
+void enableProfiler() {
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  for (byte i = 0; i < PROF_STAGES; i++) {
+    stageProfile[i].minCycles = 0xffff;
+  }
+}
+
+/**
+ * Add the cycles since start to a stage's profile.
+ */
+void profileRecord(byte stage, unsigned int start) {
+  unsigned int cycles = TCNT1 - start;
+  StageProfile &prof = stageProfile[stage];
+  if (cycles < prof.minCycles) {
+    prof.minCycles = cycles;
+  }
+  if (cycles > prof.maxCycles) {
+    prof.maxCycles = cycles;
+  }
+  prof.totalCycles += cycles;
+  prof.count++;
+}
+
+/**
+ * Send the profile of one stage per call while a dump is in progress:
+ * F0 7D 02 <stage> <min> <mean> <max> F7, each count as three 7-bit
+ * bytes (high bits first). Start a dump by setting profileDumpNext to 0.
+ */
+void dumpProfile() {
+  if (profileDumpNext >= PROF_STAGES) {
+    return;
+  }
+  StageProfile &prof = stageProfile[profileDumpNext];
+  unsigned int values[3];
+  values[0] = prof.count ? prof.minCycles : 0;
+  values[1] = prof.count ? prof.totalCycles / prof.count : 0;
+  values[2] = prof.maxCycles;
+  
+  if (debugging()) {
+    if (debugHasRoom(3)) {
+      for (byte i = 0; i < 3; i++) {
+        debugRecord(DBG_PROFILE, profileDumpNext * 4 + i, values[i]);
+      }
+      profileDumpNext++;
     }
+    return;
+  }
+  
+  byte msg[5 + 3 * 3];
+  byte len = 0;
+  msg[len++] = MIDI_SYSEX_START;
+  msg[len++] = SYSEX_ID;
+  msg[len++] = SYSEX_PROFILE_DUMP;
+  msg[len++] = profileDumpNext;
+  for (byte i = 0; i < 3; i++) {
+    msg[len++] = values[i] >> 14;
+    msg[len++] = (values[i] >> 7) & 0x7f;
+    msg[len++] = values[i] & 0x7f;
+  }
+  msg[len++] = MIDI_SYSEX_END;
+  if (transportSysex(msg, len)) {
+    profileDumpNext++;
+  }
 }
+#endif
 
-void loop() {
+/**
+ * Return the current value of a COUNTER_*.
+ */
+unsigned int counterValue(byte counter) {
+  unsigned int value = 0;
+  uint8_t oldSREG = SREG;
+  cli();
+  switch (counter) {
+    case COUNTER_MIDI_IN_DROPPED:
+      value = midiInDropped;
+      break;
+    case COUNTER_TICK_OVERRUNS:
+      value = tickOverruns;
+      break;
+  }
+  SREG = oldSREG;
+  return value;
+}
+
+/**
+ * Send one counter per call while a dump is in progress: F0 7D 05
+ * <counter> <value> F7, the value as three 7-bit bytes (high bits
+ * first). Start a dump by setting counterDumpNext to 0.
+ */
+void dumpCounters() {
+  if (counterDumpNext >= COUNTERS) {
+    return;
+  }
+  unsigned int value = counterValue(counterDumpNext);
+  
+  if (debugging()) {
+    if (debugHasRoom(1)) {
+      debugRecord(DBG_COUNTER, counterDumpNext, value);
+      counterDumpNext++;
+    }
+    return;
+  }
   
-  if (digitalRead(PANIC_PIN) == 0) {
+  byte msg[8];
+  byte len = 0;
+  msg[len++] = MIDI_SYSEX_START;
+  msg[len++] = SYSEX_ID;
+  msg[len++] = SYSEX_COUNTER_DUMP;
+  msg[len++] = counterDumpNext;
+  msg[len++] = value >> 14;
+  msg[len++] = (value >> 7) & 0x7f;
+  msg[len++] = value & 0x7f;
+  msg[len++] = MIDI_SYSEX_END;
+  if (transportSysex(msg, len)) {
+    counterDumpNext++;
+  }
+}
+
+/**
+ * Run a system command, chosen by the chord held when the meta key is
+ * released after pressing panic with the meta key down.
+ */
+void runSystemCommand(unsigned char value) {
+  switch (value) {
+    case SYS_CALIBRATE_SLIDE:
+      startSlideCalibration();
+      break;
+    case SYS_DUMP_LATENCY:
+      latencyDumpNext = 0;
+      latencyDumpBucket = 0;
+      break;
+    case SYS_DUMP_COUNTERS:
+      counterDumpNext = 0;
+      break;
+#if LOOP_PROFILER
+    case SYS_DUMP_PROFILE:
+      profileDumpNext = 0;
+      break;
+#endif
+    case SYS_LEGATO:
+      config.legatoMode = (config.legatoMode + 1) % LEGATO_MODES;
+      configChanged();
+      break;
+    case SYS_TOGGLE_SLIDE_QUANT:
+      config.slideQuant = !config.slideQuant;
+      configChanged();
+      break;
+    case SYS_SAVE_CONFIG:
+      saveConfig();
+      break;
+    case SYS_ZERO_BREATH:
+      startBreathZero();
+      break;
+    case SYS_CAPTURE:
+      setUartMode(uartMode == UART_CAPTURE ? UART_MIDI : UART_CAPTURE);
+      break;
+    case SYS_DEBUG:
+      setUartMode(uartMode == UART_DEBUG ? UART_MIDI : UART_DEBUG);
+      break;
+  }
+}
+
+/**
+ * Wait until everything queued for the UART has gone out, the last byte
+ * included.
+ */
+void waitForTxIdle() {
+  while (MIDI_UCSRB & _BV(MIDI_UDRIE)) {
+    WAIT_FOR_INTERRUPT();
+  }
+  delayMicroseconds(TX_DRAIN_US);
+}
+
+/**
+ * Switch what the UART carries. Leaving MIDI, everything sounding is
+ * turned off and the MIDI queues drain first. Coming back to MIDI, the
+ * records already queued go out first, and since notes played meanwhile
+ * were never sent, the note state is cleared with an all notes off
+ * (which also sets the receiver straight after whatever it made of the
+ * records).
+ */
+void setUartMode(byte mode) {
+  if (mode == uartMode) {
+    return;
+  }
+  if (uartMode == UART_MIDI) {
+    allNotesOff();
+  }
+  waitForTxIdle();
+  recordHead = 0;
+  recordTail = 0;
+  captureSequence = 0;
+  captureCountdown = CAPTURE_PERIOD;
+  debugDropped = 0;
+  uartMode = mode;
+  if (mode == UART_MIDI) {
+    MIDI_UCSRA &= ~_BV(MIDI_U2X);
+    midiPortInit();
+    runningStatus = 0;
+    resetMidiIn();
     allNotesOff();
+  } else {
+    MIDI_UCSRA |= _BV(MIDI_U2X);
+    MIDI_UBRR = RECORD_UBRR;
+  }
+}
+
+/**
+ * Queue a record for the UART. Returns false, queueing nothing, if there
+ * isn't room for all of it.
+ */
+boolean queueRecord(const byte *record, byte size) {
+  byte head = recordHead;
+  byte used = (head - recordTail) & (RECORD_BUFFER_SIZE - 1);
+  if (RECORD_BUFFER_SIZE - 1 - used < size) {
+    return false;
+  }
+  for (byte i = 0; i < size; i++) {
+    recordBuffer[head] = record[i];
+    head = (head + 1) & (RECORD_BUFFER_SIZE - 1);
+  }
+  recordHead = head;
+  MIDI_UCSRB |= _BV(MIDI_UDRIE);
+  return true;
+}
+
+/**
+ * Queue a capture record, if one is due. If the link is behind, the
+ * record is dropped, and the sequence number shows it.
+ */
+void captureSample(byte switches) {
+  if (!stageDue(captureCountdown, CAPTURE_PERIOD)) {
+    return;
   }
+  byte record[CAPTURE_RECORD_SIZE];
+  unsigned int time = adcLatestTime(ADC_BREATH);
+  record[0] = CAPTURE_SYNC;
+  record[1] = captureSequence++;
+  record[2] = time & 0xff;
+  record[3] = time >> 8;
+  record[8] = 0;
+  for (byte ch = 0; ch < ADC_CHANNELS; ch++) {
+    int val = adcLatest(ch);
+    record[4 + ch] = val & 0xff;
+    record[8] |= (val >> 8) << (2 * ch);
+  }
+  record[9] = switches;
+  byte check = 0;
+  for (byte i = 1; i < CAPTURE_RECORD_SIZE - 1; i++) {
+    check ^= record[i];
+  }
+  record[CAPTURE_RECORD_SIZE - 1] = check;
+  queueRecord(record, CAPTURE_RECORD_SIZE);
+}
+
+/**
+ * True in debug mode.
+ */
+boolean debugging() {
+  return uartMode == UART_DEBUG;
+}
+
+/**
+ * True if this many debug records, and a drop report ahead of them,
+ * would fit now.
+ */
+boolean debugHasRoom(byte records) {
+  byte used = (recordHead - recordTail) & (RECORD_BUFFER_SIZE - 1);
+  return RECORD_BUFFER_SIZE - 1 - used >= (records + 1) * DEBUG_RECORD_SIZE;
+}
+
+/**
+ * Build a debug record and queue it. Returns false if it didn't fit.
+ */
+boolean queueDebugRecord(byte type, byte channel, unsigned int value) {
+  unsigned int time = micros();
+  byte record[DEBUG_RECORD_SIZE];
+  record[0] = DEBUG_SYNC;
+  record[1] = type;
+  record[2] = channel;
+  record[3] = value & 0xff;
+  record[4] = value >> 8;
+  record[5] = time & 0xff;
+  record[6] = time >> 8;
+  byte check = 0;
+  for (byte i = 1; i < DEBUG_RECORD_SIZE - 1; i++) {
+    check ^= record[i];
+  }
+  record[DEBUG_RECORD_SIZE - 1] = check;
+  return queueRecord(record, DEBUG_RECORD_SIZE);
+}
+
+/**
+ * Queue a debug record for an event, in debug mode. If there's no room
+ * it's counted as dropped, and the count goes out ahead of the next
+ * record that fits.
+ */
+void debugRecord(byte type, byte channel, unsigned int value) {
+  if (!debugging()) {
+    return;
+  }
+  if (debugDropped) {
+    if (!debugHasRoom(1)) {
+      debugDropped++;
+      return;
+    }
+    queueDebugRecord(DBG_DROPPED, 0, debugDropped);
+    debugDropped = 0;
+  }
+  if (!queueDebugRecord(type, channel, value)) {
+    debugDropped++;
+  }
+}
+
+void loop() {
   
-  if (digitalRead(META_SW_PIN) == 0) {
-    metaMode = true;
-    metaValue = getRawOvertoneSwitchValue();
+  // Wait for the next control tick, or while idle for a handful of them
+  if (0 == pendingTicks || (idle && pendingTicks < IDLE_TICK_DIVIDER)) {
+    if (idle) {
+      updateBreathOnset();
+      sleepUntilInterrupt();
+    }
+    return;
+  }
+  cli();
+  byte ticks = pendingTicks;
+  pendingTicks = 0;
+  sei();
+  controlTicks += ticks;
+  PROFILE_BEGIN(PROF_PASS);
+  refillControllerBuckets(ticks);
+  readMidiIn();
+  
+  // Every switch decision this tick works from the same snapshot
+  PROFILE_BEGIN(PROF_SWITCHES);
+  byte switches = readSwitches();
+  unsigned int switchTime = micros();
+  
+  // Panic fires once per press of the panic switch, unless the meta key
+  // is down, in which case it makes the meta press a system command
+  boolean panicDown = switchDown(switches, PANIC_PIN);
+  
+  if (switchDown(switches, META_SW_PIN)) {
+    if (!metaMode) {
+      metaMode = true;
+      metaSystem = false;
+    }
+    metaValue = getRawOvertoneSwitchValue(switches);
+    if (panicDown) {
+      metaSystem = true;
+    }
   } else if (metaMode == true) {
-    // Meta switch was just released - send meta command
+    // Meta switch was just released - run or send the meta command
     metaMode = false;
-    sendMetaCommand(1, metaValue);
+    if (metaSystem) {
+      runSystemCommand(metaValue);
+    } else if (-1 != slideCalStep) {
+      recordSlideCalibrationPoint();
+    } else {
+      sendMetaCommand(META_CHANNEL, metaValue);
+    }
+  }
+  
+  if (panicDown && !panicPressed && !metaMode) {
+    allNotesOff();
   }
+  panicPressed = panicDown;
+  PROFILE_END(PROF_SWITCHES);
   
-  int pb = getPitchBend();
-  int note = getMIDINote();
-  int volume = getVolume();
-  int x = getXValue();
-  int y = getYValue();
+  PROFILE_BEGIN(PROF_READ);
+  readControllers();
+  PROFILE_END(PROF_READ);
+  if (stageDue(noteCountdown, NOTE_PERIOD)) {
+    PROFILE_BEGIN(PROF_NOTE);
+    int newNote = getMIDINote(settleChord(getRawOvertoneSwitchValue(switches)));
+    if (newNote != note) {
+      note = newNote;
+      noteTime = switchTime;
+    }
+    PROFILE_END(PROF_NOTE);
+  }
+  PROFILE_BEGIN(PROF_ONSET);
+  updateBreathOnset();
+  PROFILE_END(PROF_ONSET);
   
-  if ((-1 != currentNote) && (0 == volume)) {
+  if ((-1 != currentNote) && !breathGate) {
     // Breath stopped, so send a note off
-    sendNoteOff(currentNote, 0, 0, DEBUG);
+    sendNoteOff(currentNote, 0, PLAY_CHANNEL, onsetLastTime);
     currentNote = -1;
-  } else if ((-1 == currentNote) && (0 != volume) && (-1 != note)) {
+    currentPitch = -1;
+  } else if ((-1 == currentNote) && breathGate && (-1 != note)) {
     // No note was playing, and we have breath and a valid overtone, so send a note on.
     // Be sure to send any updated pitch bend first, though, in case the slide moved.
     // And also send updated breath controller info so volume is correct.
-    sendBreathController(volume, 0, DEBUG);
-    sendPitchBend(pb, DEBUG);
-    sendXYControllers(x, y, 0, DEBUG);
-    sendNoteOn(note, 127, 0, DEBUG);
     currentNote = note;
-  } else if ((-1 != currentNote) && (note != currentNote)) {
+    currentPitch = note;
+    sendControllers(true);
+    sendNoteOn(note, onsetVelocity, PLAY_CHANNEL, onsetTime);
+  } else if ((-1 != currentNote) && (note != currentPitch)) {
     // A note was playing, but the player has moved to a different note.
-    // Turn off the old note and turn on the new one.
-    sendNoteOff(currentNote, 0, 0, DEBUG);
-    sendPitchBend(pb, DEBUG);
-    sendBreathController(volume, 0, DEBUG);
-    sendXYControllers(x, y, 0, DEBUG);
-    sendNoteOn(note, 127, 0, DEBUG);
-    currentNote = note;
+    changeNote(note, noteTime);
   } else if (-1 != currentNote) {
-    // Send updated breath controller and pitch bend values.
-    if (millis() > ccSendTime + MIN_CC_INTERVAL) {
-      sendPitchBend(pb, DEBUG);
-      sendBreathController(volume, 0, DEBUG);
-      sendXYControllers(x, y, 0, DEBUG);
-      ccSendTime = millis();
-    }
+    // Send updated breath controller and pitch bend values, as the link allows.
+    sendControllers(false);
+  }
+  
+  updateIdle(switches);
+  
+  if (uartMode == UART_CAPTURE) {
+    captureSample(switches);
+  }
+  dumpLatencyHistograms();
+  dumpCounters();
+  dumpConfig();
+  saveConfigStep();
+  saveSlideCalibrationStep();
+#if LOOP_PROFILER
+  dumpProfile();
+#endif
+  transportFlush();
+  PROFILE_END(PROF_PASS);
+  
+  // If another tick came in while we were working, this pass ran over budget
+  if (pendingTicks) {
+    reportTickOverrun();
   }
-  delay(50);
 }
 
 
+#ifndef TROMBONE_NO_MAIN
 int main(void)
 {
 	init();
 
+#if USB_MIDI
+	USBDevice.attach();
+#endif
+
 	setup();
     
 	for (;;)
@@ -465,4 +3730,4 @@ int main(void)
         
 	return 0;
 }
-
+#endif
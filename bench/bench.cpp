@@ -0,0 +1,329 @@
+/*
+
+Microbenchmarks for the sketch's hot functions, so a table or
+fixed-point replacement can be shown to be faster before it goes in.
+
+Each kernel is one call of a sketch function, run over a fixed sweep of
+inputs with interrupts off, and timed call by call with Timer1 running
+straight off the CPU clock. The cost of reading the timer around an
+empty call is taken off every figure. The table of cycles per call (min,
+mean and max over the sweep) goes out of the MIDI port at BENCH_BAUD,
+every few seconds so a terminal opened late still gets it:
+
+  kernel                calls    min   mean    max  (cycles)
+  empty                    16      0      0      0
+  chord decode             16    ...
+
+Built for the host (see the Makefile) the same suite runs against the
+stand-ins in host/ and times in nanoseconds with the host's clock, once.
+Host figures are only good for comparing one version of a kernel with
+another; the AVR ones are what counts.
+
+Kernels that queue MIDI leave the queue as they found it after each
+call, so every call does the same work; nothing goes on the wire.
+
+*/
+#define TROMBONE_NO_MAIN
+#include "../Trombone_3D_Live_04_05_2011.cpp"
+
+#include <stdio.h>
+
+#ifdef BENCH_HOST
+#include <chrono>
+
+typedef unsigned long BenchTime;
+const char *const BENCH_UNIT = "ns";
+
+/**
+ * Nanoseconds on the host's clock.
+ */
+static BenchTime benchClock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+typedef unsigned int BenchTime;
+const char *const BENCH_UNIT = "cycles";
+const long BENCH_BAUD = 115200;
+const unsigned int BENCH_UBRR = F_CPU / 8 / BENCH_BAUD - 1; // With U2X set
+const unsigned long BENCH_REPEAT_MS = 5000; // Time between runs of the suite
+#define benchClock() TCNT1
+#endif
+
+// A kernel's input goes through benchArg and its result into benchSink.
+// Both are volatile, so the compiler can't move the work out from
+// between the two timer reads, even when it inlines the function.
+volatile unsigned int benchArg;
+volatile long benchSink;
+
+#define BENCH_START() BenchTime benchStart = benchClock()
+#define BENCH_STOP() ((BenchTime) (benchClock() - benchStart))
+
+/**
+ * One kernel: run it once for input i, returning the time it took.
+ * Setting up and cleaning up goes outside BENCH_START() and BENCH_STOP().
+ */
+typedef BenchTime (*BenchKernel)(unsigned int i);
+
+struct Bench {
+  const char *name;
+  BenchKernel kernel;
+  unsigned int calls; // Inputs in the sweep, i = 0 to calls - 1
+};
+
+static BenchTime benchEmpty(unsigned int i) {
+  benchArg = i;
+  BENCH_START();
+  benchSink = benchArg;
+  return BENCH_STOP();
+}
+
+static BenchTime benchChordDecode(unsigned int i) {
+  benchArg = i;
+  BENCH_START();
+  benchSink = getOvertoneFromOvertoneSwitches(benchArg);
+  return BENCH_STOP();
+}
+
+static BenchTime benchChordRead(unsigned int i) {
+  benchArg = i;
+  BENCH_START();
+  benchSink = getRawOvertoneSwitchValue(benchArg);
+  return BENCH_STOP();
+}
+
+static BenchTime benchMidiNote(unsigned int i) {
+  benchArg = i;
+  BENCH_START();
+  benchSink = getMIDINote(benchArg);
+  return BENCH_STOP();
+}
+
+// 1st to 7th position and past both ends, in raw ADC steps of 4
+static BenchTime benchSlideMap(unsigned int i) {
+  benchArg = i * 4;
+  BENCH_START();
+  benchSink = slideToPitchBend(benchArg * SLIDE_SCALE);
+  return BENCH_STOP();
+}
+
+// The whole pitch bend range, steps of 64, hysteresis included
+static BenchTime benchSlideQuantize(unsigned int i) {
+  benchArg = i * 64;
+  BENCH_START();
+  benchSink = quantizeSlide(benchArg);
+  return BENCH_STOP();
+}
+
+// The breath lane's reading through its curve (ROUTE_CURVE_BREATH by
+// default), over the whole breath range in steps of 4; the other lanes
+// aren't due
+static BenchTime benchBreathVolume(unsigned int i) {
+  adcRing[ADC_BREATH][adcHead[ADC_BREATH]] = i * 4;
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    routeState[lane].countdown = CC_LANE_BREATH == lane ? 1 : 2;
+  }
+  BENCH_START();
+  readControllers();
+  BenchTime elapsed = BENCH_STOP();
+  benchSink = routeState[CC_LANE_BREATH].value;
+  return elapsed;
+}
+
+// Every controller lane's reading and curve, all due at once
+static BenchTime benchReadControllers(unsigned int i) {
+  for (byte ch = 0; ch < ADC_CHANNELS; ch++) {
+    adcRing[ch][adcHead[ch]] = (i * 4 + ch * 256) & 1023;
+  }
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    routeState[lane].countdown = 1;
+  }
+  BENCH_START();
+  readControllers();
+  return BENCH_STOP();
+}
+
+// The X lane swept up and down; the bucket kept full
+static BenchTime benchControllerMaySend(unsigned int i) {
+  ccTokens[CC_LANE_X] = CC_BUCKET_DEPTH;
+  benchArg = i < 128 ? i : 255 - i;
+  BENCH_START();
+  trackControllerMotion(CC_LANE_X, benchArg);
+  benchSink = controllerMaySend(CC_LANE_X, benchArg, 64, false);
+  return BENCH_STOP();
+}
+
+/**
+ * Put the MIDI queues back the way they were, empty, and keep the
+ * transmitter from draining them.
+ */
+static void benchClearMidi() {
+  MIDI_UCSRB &= ~_BV(MIDI_UDRIE);
+  noteQueueHead = noteQueueTail;
+  ccPending = 0;
+  ccRound = 0;
+  ccSlotCount = 0;
+  txIndex = txLength;
+  noteLaneTokens = 0;
+}
+
+static BenchTime benchQueueNote(unsigned int i) {
+  benchArg = 36 + i % 48;
+  BENCH_START();
+  midiQueueNote(MIDI_NOTE_ON | PLAY_CHANNEL, benchArg, 100, 0);
+  BenchTime elapsed = BENCH_STOP();
+  benchClearMidi();
+  return elapsed;
+}
+
+// A new controller every second call, the one already waiting otherwise
+static BenchTime benchQueueController(unsigned int i) {
+  if (i & 1) {
+    midiQueueController(MIDI_CONTROL_CHANGE | PLAY_CHANNEL, X_CC, 0, 0);
+  }
+  benchArg = i & 0x7f;
+  BENCH_START();
+  midiQueueController(MIDI_CONTROL_CHANGE | PLAY_CHANNEL, X_CC, benchArg, 0);
+  BenchTime elapsed = BENCH_STOP();
+  benchClearMidi();
+  return elapsed;
+}
+
+static BenchTime benchQueuePitchBend(unsigned int i) {
+  benchArg = i * 64;
+  BENCH_START();
+  midiQueueController(MIDI_PITCH_BEND | PLAY_CHANNEL, benchArg & 0x7f, (benchArg >> 7) & 0x7f, 0);
+  BenchTime elapsed = BENCH_STOP();
+  benchClearMidi();
+  return elapsed;
+}
+
+// Picking the next message and encoding it, running status and all:
+// a note, then a controller, then a pitch bend, round and round
+static BenchTime benchTxNext(unsigned int i) {
+  switch (i % 3) {
+    case 0:
+      midiQueueNote(MIDI_NOTE_ON | PLAY_CHANNEL, 60, i & 0x7f, 0);
+      break;
+    case 1:
+      midiQueueController(MIDI_CONTROL_CHANGE | PLAY_CHANNEL, MIDI_BREATH_CC, i & 0x7f, 0);
+      break;
+    case 2:
+      midiQueueController(MIDI_PITCH_BEND | PLAY_CHANNEL, i & 0x7f, 0x40, 0);
+      break;
+  }
+  BENCH_START();
+  benchSink = midiTxNext();
+  BenchTime elapsed = BENCH_STOP();
+  benchClearMidi();
+  return elapsed;
+}
+
+const Bench benches[] = {
+  {"empty", benchEmpty, 16},
+  {"chord decode", benchChordDecode, 16},
+  {"chord read", benchChordRead, 256},
+  {"midi note", benchMidiNote, 16},
+  {"slide map", benchSlideMap, 256},
+  {"slide quantize", benchSlideQuantize, 256},
+  {"breath volume", benchBreathVolume, 256},
+  {"read controllers", benchReadControllers, 256},
+  {"controller may send", benchControllerMaySend, 256},
+  {"queue note", benchQueueNote, 48},
+  {"queue controller", benchQueueController, 128},
+  {"queue pitch bend", benchQueuePitchBend, 256},
+  {"tx next", benchTxNext, 96}
+};
+const byte BENCHES = sizeof(benches) / sizeof(benches[0]);
+
+/**
+ * Send a line of the table.
+ */
+static void benchPrint(const char *s) {
+#ifdef BENCH_HOST
+  fputs(s, stdout);
+#else
+  while (*s) {
+    while (!(MIDI_UCSRA & _BV(MIDI_UDRE))) {
+    }
+    MIDI_UDR = *s++;
+  }
+#endif
+}
+
+/**
+ * Run every kernel over its sweep and print the table. The empty
+ * kernel goes first, and its least time is taken off everything,
+ * itself included.
+ */
+static void benchRun() {
+  char line[64];
+  BenchTime overhead = 0;
+  snprintf(line, sizeof(line), "%-20s %6s %6s %6s %6s  (%s)\r\n", "kernel", "calls", "min", "mean", "max", BENCH_UNIT);
+  benchPrint(line);
+  for (byte b = 0; b < BENCHES; b++) {
+    BenchTime least = (BenchTime) -1;
+    BenchTime most = 0;
+    unsigned long total = 0;
+    for (unsigned int i = 0; i < benches[b].calls; i++) {
+      uint8_t oldSREG = SREG;
+      cli();
+      BenchTime t = benches[b].kernel(i);
+      SREG = oldSREG;
+      t = t > overhead ? t - overhead : 0;
+      if (t < least) {
+        least = t;
+      }
+      if (t > most) {
+        most = t;
+      }
+      total += t;
+    }
+    if (0 == b) {
+      overhead = least;
+      total -= (unsigned long) least * benches[b].calls;
+      most -= least;
+      least = 0;
+    }
+    snprintf(line, sizeof(line), "%-20s %6u %6lu %6lu %6lu\r\n", benches[b].name, benches[b].calls,
+             (unsigned long) least, total / benches[b].calls, (unsigned long) most);
+    benchPrint(line);
+  }
+  benchPrint("\r\n");
+}
+
+/**
+ * Just enough of setup() for the kernels: the settings, the slide map
+ * and the breath levels, but no ADC scan, control tick or MIDI in.
+ */
+static void benchSetup() {
+  loadConfig();
+  loadSlideCalibration();
+  setBreathLevels();
+  for (byte lane = 0; lane < CC_LANES; lane++) {
+    routeState[lane].countdown = 1;
+    routeState[lane].value = -1;
+  }
+#ifndef BENCH_HOST
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);  // Count CPU cycles
+  MIDI_UCSRA |= _BV(MIDI_U2X);
+  MIDI_UBRR = BENCH_UBRR;
+  MIDI_UCSRB = _BV(MIDI_TXEN);
+  MIDI_UCSRC = _BV(MIDI_UCSZ1) | _BV(MIDI_UCSZ0);
+#endif
+}
+
+int main(void) {
+  init();
+  benchSetup();
+#ifdef BENCH_HOST
+  benchRun();
+#else
+  for (;;) {
+    benchRun();
+    delay(BENCH_REPEAT_MS);
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+
+Turn a raw sensor capture (the sketch's SYS_CAPTURE mode, recorded off
+the serial port at 1 Mbaud) into a trace for replay.
+
+  capture2trace capture.bin > capture.trace
+
+The record layout is described with CAPTURE_SYNC in the sketch. Records
+that fail their checksum are skipped by searching for the next sync
+byte. Times are unwrapped from the 16-bit stamps and start at 0. Dropped
+records, from the sequence numbers, are counted on stderr; a gap longer
+than 256 records can't be told from a shorter one.
+
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+const uint8_t CAPTURE_SYNC = 0xA5; // Must match the sketch
+const size_t CAPTURE_RECORD_SIZE = 11;
+const int CHANNELS = 4;
+
+/**
+ * True if a whole, intact record starts at p.
+ */
+static bool validRecord(const uint8_t *p) {
+  if (p[0] != CAPTURE_SYNC) {
+    return false;
+  }
+  uint8_t check = 0;
+  for (size_t i = 1; i < CAPTURE_RECORD_SIZE - 1; i++) {
+    check ^= p[i];
+  }
+  return check == p[CAPTURE_RECORD_SIZE - 1];
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: capture2trace capture.bin > capture.trace\n");
+    return 2;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  fclose(f);
+
+  unsigned long records = 0;
+  unsigned long dropped = 0;
+  unsigned long skipped = 0; // Bytes thrown away looking for a record
+  unsigned long time = 0;
+  uint16_t lastStamp = 0;
+  uint8_t lastSequence = 0;
+  printf("# time_us breath slide x y portd, from %s\n", argv[1]);
+  size_t i = 0;
+  while (i + CAPTURE_RECORD_SIZE <= data.size()) {
+    const uint8_t *p = &data[i];
+    if (!validRecord(p)) {
+      skipped++;
+      i++;
+      continue;
+    }
+    uint8_t sequence = p[1];
+    uint16_t stamp = p[2] | (p[3] << 8);
+    if (records) {
+      dropped += (uint8_t) (sequence - lastSequence - 1);
+      time += (uint16_t) (stamp - lastStamp);
+    }
+    lastSequence = sequence;
+    lastStamp = stamp;
+    unsigned int value[CHANNELS];
+    for (int ch = 0; ch < CHANNELS; ch++) {
+      value[ch] = p[4 + ch] | (((p[8] >> (2 * ch)) & 3) << 8);
+    }
+    printf("%lu %u %u %u %u %02x\n", time, value[0], value[1], value[2], value[3], p[9]);
+    records++;
+    i += CAPTURE_RECORD_SIZE;
+  }
+  skipped += data.size() - i;
+  fprintf(stderr, "%lu records, %lu dropped, %lu bytes skipped\n", records, dropped, skipped);
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+
+Print the sketch's binary debug records (SYS_DEBUG mode, recorded off
+the serial port at 1 Mbaud) as text, one event per line:
+
+  debugdump debug.bin
+
+  <time us> <event> <channel> <value>
+
+The record layout and event types are described with DEBUG_SYNC in the
+sketch. Records that fail their checksum are skipped by searching for
+the next sync byte. Times are unwrapped from the 16-bit stamps and start
+at 0, so a gap of more than 65 ms between events comes out short.
+
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+const uint8_t DEBUG_SYNC = 0x5A; // Must match the sketch
+const size_t DEBUG_RECORD_SIZE = 8;
+const int LAT_BUCKETS = 16;
+const int LAT_MEASURES = 2;
+
+// Indexed by event type
+const char *const eventNames[] = {
+  "?", "ON", "OFF", "BEND", "BC", "X", "Y", "PANIC", "META", "OVERRUN", "CAL", "LAT", "PROF", "DROPPED", "ZERO",
+  "COUNT"
+};
+const uint8_t EVENT_TYPES = sizeof(eventNames) / sizeof(eventNames[0]);
+const uint8_t DBG_OVERRUN = 0x09;
+const uint8_t DBG_CAL_POINT = 0x0a;
+const uint8_t DBG_LATENCY = 0x0b;
+const uint8_t DBG_PROFILE = 0x0c;
+const uint8_t DBG_DROPPED = 0x0d;
+const uint8_t DBG_BREATH_ZERO = 0x0e;
+const uint8_t DBG_COUNTER = 0x0f;
+
+/**
+ * True if a whole, intact record starts at p.
+ */
+static bool validRecord(const uint8_t *p) {
+  if (p[0] != DEBUG_SYNC || p[1] == 0 || p[1] >= EVENT_TYPES) {
+    return false;
+  }
+  uint8_t check = 0;
+  for (size_t i = 1; i < DEBUG_RECORD_SIZE - 1; i++) {
+    check ^= p[i];
+  }
+  return check == p[DEBUG_RECORD_SIZE - 1];
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: debugdump debug.bin\n");
+    return 2;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  fclose(f);
+
+  unsigned long records = 0;
+  unsigned long dropped = 0;
+  unsigned long skipped = 0; // Bytes thrown away looking for a record
+  unsigned long time = 0;
+  uint16_t lastStamp = 0;
+  size_t i = 0;
+  while (i + DEBUG_RECORD_SIZE <= data.size()) {
+    const uint8_t *p = &data[i];
+    if (!validRecord(p)) {
+      skipped++;
+      i++;
+      continue;
+    }
+    uint8_t type = p[1];
+    uint8_t channel = p[2];
+    unsigned int value = p[3] | (p[4] << 8);
+    uint16_t stamp = p[5] | (p[6] << 8);
+    if (records) {
+      time += (uint16_t) (stamp - lastStamp);
+    }
+    lastStamp = stamp;
+    records++;
+    i += DEBUG_RECORD_SIZE;
+
+    printf("%lu %s", time, eventNames[type]);
+    switch (type) {
+      case DBG_LATENCY:
+        printf(" class %d measure %d bucket %d count %u\n",
+               channel / LAT_BUCKETS / LAT_MEASURES, channel / LAT_BUCKETS % LAT_MEASURES,
+               channel % LAT_BUCKETS, value);
+        break;
+      case DBG_PROFILE: {
+        const char *const stats[] = {"min", "mean", "max", "?"};
+        printf(" stage %d %s %u\n", channel >> 2, stats[channel & 3], value);
+        break;
+      }
+      case DBG_CAL_POINT:
+        printf(" step %d slide %u\n", channel, value);
+        break;
+      case DBG_BREATH_ZERO:
+        printf(" noise %d rest %u\n", channel, value);
+        break;
+      case DBG_COUNTER:
+        printf(" counter %d %u\n", channel, value);
+        break;
+      case DBG_OVERRUN:
+      case DBG_DROPPED:
+        printf(" %u\n", value);
+        if (type == DBG_DROPPED) {
+          dropped += value;
+        }
+        break;
+      default:
+        printf(" %d %u\n", channel, value);
+    }
+  }
+  skipped += data.size() - i;
+  fprintf(stderr, "%lu records, %lu dropped, %lu bytes skipped\n", records, dropped, skipped);
+  return 0;
+}
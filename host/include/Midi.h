@@ -0,0 +1,13 @@
+/*
+
+Host stand-in for the Midi library. The sketch only declares an
+instance; nothing is called on it.
+
+*/
+#ifndef MIDI_H__
+#define MIDI_H__
+
+class MidiClass {
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*
+
+Host stand-in for the Arduino core, just enough to build the sketch
+against the simulated ATmega328P in sim.cpp.
+
+*/
+#ifndef WProgram_h
+#define WProgram_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000L
+#endif
+
+#ifndef abs
+#define abs(x) ((x)>0?(x):-(x))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+typedef uint8_t boolean;
+typedef uint8_t byte;
+
+void init(void);
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Spin-wait hook used by the sketch: let the simulated peripherals run
+// up to their next event.
+void hostWaitForInterrupt(void);
+#define WAIT_FOR_INTERRUPT() hostWaitForInterrupt()
+
+#endif
@@ -0,0 +1,22 @@
+/*
+
+Host stand-in for <avr/eeprom.h>: 1 KB that starts out erased (0xff),
+like a new part.
+
+*/
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define E2END 0x3ff
+#define eeprom_is_ready() 1 // Writes finish at once
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+
+#endif
@@ -0,0 +1,27 @@
+/*
+
+Host stand-in for <avr/interrupt.h>. Interrupt handlers become plain
+functions that sim.cpp calls when their event comes due. Interrupts
+only ever run between passes of loop() or inside WAIT_FOR_INTERRUPT(),
+so cli() and sei() have nothing to do.
+
+*/
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#define ISR(vector) extern "C" void vector(void)
+
+inline void cli(void) {}
+inline void sei(void) {}
+
+// Every vector the simulator knows how to raise. Weak, so the sketch
+// only has to define the ones it uses.
+extern "C" {
+  void TIMER2_COMPA_vect(void) __attribute__((weak));
+  void ADC_vect(void) __attribute__((weak));
+  void USART_UDRE_vect(void) __attribute__((weak));
+  void USART_RX_vect(void) __attribute__((weak));
+  void PCINT2_vect(void) __attribute__((weak));
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+
+Host stand-in for <avr/io.h>, covering the ATmega328P registers the
+sketch touches. Most are plain variables that sim.cpp inspects between
+events. UDR0 and TCNT1 are objects, since writing the one and reading
+the other have side effects the simulator needs to see.
+
+*/
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#define __AVR_ATmega328P__ 1
+
+#define _BV(bit) (1 << (bit))
+
+class UdrRegister {
+public:
+  UdrRegister &operator=(uint8_t value);
+  operator uint8_t() const;
+};
+
+class Timer1Counter {
+public:
+  Timer1Counter &operator=(uint16_t value);
+  operator uint16_t() const;
+};
+
+#define HOST_REG8(name) extern volatile uint8_t name;
+HOST_REG8(PINB) HOST_REG8(DDRB) HOST_REG8(PORTB)
+HOST_REG8(PINC) HOST_REG8(DDRC) HOST_REG8(PORTC)
+HOST_REG8(PIND) HOST_REG8(DDRD) HOST_REG8(PORTD)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG8(TIMSK1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(TCNT2) HOST_REG8(OCR2A) HOST_REG8(TIMSK2) HOST_REG8(TIFR2)
+HOST_REG8(ADMUX) HOST_REG8(ADCSRA) HOST_REG8(ADCSRB) HOST_REG8(DIDR0)
+HOST_REG8(UCSR0A) HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UBRR0H) HOST_REG8(UBRR0L)
+HOST_REG8(PCICR) HOST_REG8(PCIFR) HOST_REG8(PCMSK0) HOST_REG8(PCMSK1) HOST_REG8(PCMSK2)
+HOST_REG8(SMCR) HOST_REG8(PRR) HOST_REG8(MCUSR) HOST_REG8(SREG)
+#undef HOST_REG8
+extern volatile uint16_t ADC;
+extern volatile uint16_t UBRR0;
+extern UdrRegister UDR0;
+extern Timer1Counter TCNT1;
+
+// TCCR1B
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+// TCCR2A / TCCR2B / TIMSK2
+#define WGM21 1
+#define WGM20 0
+#define CS22 2
+#define CS21 1
+#define CS20 0
+#define OCIE2A 1
+
+// ADMUX / ADCSRA
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+// UCSR0A / UCSR0B / UCSR0C
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+// PCICR / PCIFR
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+#define PCIF2 2
+
+// SMCR / PRR
+#define SM2 3
+#define SM1 2
+#define SM0 1
+#define SE 0
+#define PRTWI 7
+#define PRTIM2 6
+#define PRTIM0 5
+#define PRTIM1 3
+#define PRSPI 2
+#define PRUSART0 1
+#define PRADC 0
+
+#endif
@@ -0,0 +1,25 @@
+/*
+
+Host stand-in for <avr/sleep.h>. Sleeping just lets the simulated
+peripherals run to their next event.
+
+*/
+#ifndef _AVR_SLEEP_H_
+#define _AVR_SLEEP_H_
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC _BV(SM0)
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+#define SLEEP_MODE_PWR_SAVE (_BV(SM0) | _BV(SM1))
+
+void hostWaitForInterrupt(void);
+
+inline void set_sleep_mode(uint8_t mode) { SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | mode; }
+inline void sleep_enable(void) { SMCR |= _BV(SE); }
+inline void sleep_disable(void) { SMCR &= ~_BV(SE); }
+inline void sleep_cpu(void) { hostWaitForInterrupt(); }
+inline void sleep_mode(void) { sleep_enable(); sleep_cpu(); sleep_disable(); }
+
+#endif
@@ -0,0 +1,422 @@
+/*
+
+Replay a recorded sensor trace through the sketch on the host, and
+report what it put on the MIDI wire.
+
+  replay [-o midi.txt] [-r raw.bin] [-i midi_in.txt] [-k SCALE] [-t TAIL_MS] trace
+
+The sketch is built into this file with its own main() left out, and
+runs against the simulated ATmega328P in sim.cpp. Each pass of loop()
+that handles a tick is timed on the host. Passes cost no simulated time
+unless -k is given, in which case each pass moves the simulated clock
+on by SCALE times its host time (the ratio of AVR to host speed for this
+code), so overruns and queueing delays show up as they would on a
+slower CPU.
+
+-o writes every MIDI message as "<time us> <bytes in hex>", the time
+   being when its last byte finished.
+-r writes every byte that went out of the UART, as it went, for output
+   that isn't MIDI (a raw capture, say).
+-i plays MIDI into the sketch's MIDI in, from lines of
+   "<time us> <bytes in hex>" (see simLoadMidiIn()).
+-t keeps the simulation running for TAIL_MS after the last trace row
+   (default 100), so the tail of the output gets out.
+
+*/
+#define TROMBONE_NO_MAIN
+#include "../Trombone_3D_Live_04_05_2011.cpp"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+#include "sim.h"
+
+/**
+ * A complete MIDI message as it came off the wire.
+ */
+struct WireMessage {
+  double time; // Microseconds; when its last byte finished
+  byte status;
+  byte data[2];
+  size_t first; // Index of its first byte in the capture
+  size_t last; // Index of its last byte
+};
+
+/**
+ * Split the captured byte stream back into messages, following running
+ * status the way a receiver would. Realtime bytes are messages on their
+ * own; a SysEx counts as one message from F0 to F7.
+ */
+static std::vector<WireMessage> parseWire(const std::vector<SimTxByte> &bytes) {
+  std::vector<WireMessage> messages;
+  byte status = 0;
+  int needed = 0;
+  int have = 0;
+  WireMessage m;
+  size_t first = 0;
+  boolean inSysex = false;
+  for (size_t i = 0; i < bytes.size(); i++) {
+    byte b = bytes[i].value;
+    double t = simMicros(bytes[i].cycle);
+    if (b >= 0xf8) {
+      WireMessage rt = {t, b, {0, 0}, i, i};
+      messages.push_back(rt);
+      continue;
+    }
+    if (inSysex) {
+      if (b == MIDI_SYSEX_END) {
+        WireMessage sx = {t, MIDI_SYSEX_START, {0, 0}, first, i};
+        messages.push_back(sx);
+        inSysex = false;
+        status = 0;
+      }
+      continue;
+    }
+    if (b == MIDI_SYSEX_START) {
+      inSysex = true;
+      first = i;
+      continue;
+    }
+    if (b & 0x80) {
+      status = b;
+      needed = midiDataLength(b);
+      have = 0;
+      first = i;
+      if (needed == 0) {
+        WireMessage sc = {t, b, {0, 0}, i, i};
+        messages.push_back(sc);
+      }
+      continue;
+    }
+    if (!status || needed == 0) {
+      continue;  // Stray data byte
+    }
+    if (have == 0 && !(bytes[first].value & 0x80)) {
+      first = i;  // Running status
+    }
+    m.data[have++] = b;
+    if (have == needed) {
+      m.time = t;
+      m.status = status;
+      m.first = first;
+      m.last = i;
+      messages.push_back(m);
+      have = 0;
+      first = i + 1;
+    }
+  }
+  return messages;
+}
+
+static boolean isNoteOn(const WireMessage &m) {
+  return (m.status & 0xf0) == MIDI_NOTE_ON && m.data[1] != 0;
+}
+
+/**
+ * Latency from input events to the Note On they caused. An event counts
+ * if a Note On finishes after it and before the next event of the same
+ * kind; otherwise it's tallied as producing no note.
+ */
+struct LatencyStats {
+  unsigned int events;
+  unsigned int missed;
+  double total;
+  double worst;
+};
+
+static void measureNoteLatency(const std::vector<double> &events, const std::vector<WireMessage> &messages,
+                               LatencyStats &stats) {
+  stats.events = events.size();
+  stats.missed = 0;
+  stats.total = 0;
+  stats.worst = 0;
+  size_t m = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    while (m < messages.size() && (messages[m].time < events[i] || !isNoteOn(messages[m]))) {
+      m++;
+    }
+    double limit = i + 1 < events.size() ? events[i + 1] : 1e300;
+    if (m == messages.size() || messages[m].time >= limit) {
+      stats.missed++;
+      continue;
+    }
+    double latency = messages[m].time - events[i];
+    stats.total += latency;
+    if (latency > stats.worst) {
+      stats.worst = latency;
+    }
+  }
+}
+
+/**
+ * How far the pitch bend on the wire is from where the slide actually
+ * is. Each pitch bend is compared, from when it finished until the next
+ * one, with the bend for the slide reading in the trace at that time,
+ * mapped through the sketch's own slide map but not filtered. Times with
+ * the slide untouched are left out. Call after setup(), so the slide
+ * map is built.
+ */
+struct BendStats {
+  unsigned long samples;
+  double total;
+  double worst;
+};
+
+static void measureBendError(const std::vector<TraceRow> &rows, const std::vector<WireMessage> &messages,
+                             BendStats &stats) {
+  stats.samples = 0;
+  stats.total = 0;
+  stats.worst = 0;
+  int sent = -1;
+  size_t m = 0;
+  const unsigned long step = 100; // Microseconds between comparisons
+  for (unsigned long t = 0, row = 0; t < rows.back().time; t += step) {
+    while (m < messages.size() && messages[m].time <= t) {
+      if ((messages[m].status & 0xf0) == MIDI_PITCH_BEND) {
+        sent = messages[m].data[0] | (messages[m].data[1] << 7);
+      }
+      m++;
+    }
+    while (row + 1 < rows.size() && rows[row + 1].time <= t) {
+      row++;
+    }
+    int slide = rows[row].analog[SLIDE_LPOT_PIN];
+    if (-1 == sent || slide > config.slideNoTouch) {
+      continue;
+    }
+    double error = abs(sent - slideToPitchBend((long) slide * SLIDE_SCALE));
+    stats.samples++;
+    stats.total += error;
+    if (error > stats.worst) {
+      stats.worst = error;
+    }
+  }
+}
+
+static void printLatency(const char *what, const LatencyStats &stats) {
+  unsigned int hit = stats.events - stats.missed;
+  printf("%-26s %u events, %u without a note", what, stats.events, stats.missed);
+  if (hit) {
+    printf(", mean %.0f us, max %.0f us", stats.total / hit, stats.worst);
+  }
+  printf("\n");
+}
+
+/**
+ * Write one line per message: when its last byte finished, then its
+ * bytes as they went out (so no status byte under running status).
+ */
+static void writeMessages(const char *path, const std::vector<SimTxByte> &bytes,
+                          const std::vector<WireMessage> &messages) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  for (size_t i = 0; i < messages.size(); i++) {
+    fprintf(f, "%.0f", messages[i].time);
+    for (size_t j = messages[i].first; j <= messages[i].last; j++) {
+      fprintf(f, " %02x", bytes[j].value);
+    }
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+static void writeRaw(const char *path, const std::vector<SimTxByte> &bytes) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  for (size_t i = 0; i < bytes.size(); i++) {
+    fputc(bytes[i].value, f);
+  }
+  fclose(f);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: replay [-o midi.txt] [-r raw.bin] [-i midi_in.txt] [-k scale] [-t tail_ms] trace\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *outPath = 0;
+  const char *rawPath = 0;
+  const char *inPath = 0;
+  double scale = 0;
+  long tailMs = 100;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:r:i:k:t:")) != -1) {
+    switch (opt) {
+      case 'o':
+        outPath = optarg;
+        break;
+      case 'r':
+        rawPath = optarg;
+        break;
+      case 'i':
+        inPath = optarg;
+        break;
+      case 'k':
+        scale = atof(optarg);
+        break;
+      case 't':
+        tailMs = atol(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  if (!simLoadTrace(argv[optind]) || (inPath && !simLoadMidiIn(inPath))) {
+    return 1;
+  }
+  const std::vector<TraceRow> &rows = simTrace();
+
+  init();
+  setup();
+  uint64_t startCycle = simNow();
+  uint64_t endCycle = (uint64_t) (rows.back().time + tailMs * 1000) * (F_CPU / 1000000L);
+
+  unsigned long passes = 0;
+  unsigned long latePasses = 0; // Passes that ran into the next tick under -k
+  double hostTotal = 0;
+  double hostWorst = 0;
+  uint64_t idleCycles = 0; // Simulated time spent idle
+  unsigned long idleEntries = 0;
+  uint64_t lastCycle = simNow();
+  bool wasIdle = false;
+  while (simNow() < endCycle) {
+    if (wasIdle) {
+      idleCycles += simNow() - lastCycle;
+    }
+    if (idle && !wasIdle) {
+      idleEntries++;
+    }
+    lastCycle = simNow();
+    wasIdle = idle;
+    unsigned long ticksBefore = controlTicks;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    loop();
+    double hostNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+    if (controlTicks == ticksBefore) {
+      // Nothing to do until the next interrupt
+      if (!simStep()) {
+        break;
+      }
+      continue;
+    }
+    passes++;
+    hostTotal += hostNs;
+    if (hostNs > hostWorst) {
+      hostWorst = hostNs;
+    }
+    if (scale > 0) {
+      simRunUntil(simNow() + (uint64_t) (hostNs * scale * (F_CPU / 1e9)));
+      if (pendingTicks) {
+        latePasses++;
+      }
+    }
+  }
+
+  const std::vector<SimTxByte> &bytes = simTxBytes();
+  std::vector<WireMessage> messages = parseWire(bytes);
+  if (outPath) {
+    writeMessages(outPath, bytes, messages);
+  }
+  if (rawPath) {
+    writeRaw(rawPath, bytes);
+  }
+
+  // Note-change events: the overtone switches changing. Breath onsets:
+  // the raw breath reading coming up through the onset detector's level,
+  // as setup() measured it.
+  byte chordMask = _BV(OT_SW_0_PIN) | _BV(OT_SW_1_PIN) | _BV(OT_SW_2_PIN) | _BV(OT_SW_3_PIN);
+  std::vector<double> chordChanges;
+  std::vector<double> breathOnsets;
+  for (size_t i = 1; i < rows.size(); i++) {
+    if ((rows[i].port ^ rows[i - 1].port) & chordMask) {
+      chordChanges.push_back(rows[i].time);
+    }
+    if (rows[i].analog[BREATH_PIN] >= breathOnsetLevel &&
+        rows[i - 1].analog[BREATH_PIN] < breathOnsetLevel) {
+      breathOnsets.push_back(rows[i].time);
+    }
+  }
+
+  unsigned long counts[8] = {0}; // Indexed by the top three bits of the status
+  unsigned long sysex = 0;
+  unsigned long realtime = 0;
+  for (size_t i = 0; i < messages.size(); i++) {
+    if (messages[i].status == MIDI_SYSEX_START) {
+      sysex++;
+    } else if (messages[i].status >= MIDI_REALTIME) {
+      realtime++;
+    } else if (messages[i].status < 0xf0) {
+      counts[(messages[i].status >> 4) & 7]++;
+    }
+  }
+  unsigned long noteOns = 0;
+  unsigned long velocityTotal = 0;
+  int velocityMin = 127;
+  int velocityMax = 0;
+  for (size_t i = 0; i < messages.size(); i++) {
+    if (isNoteOn(messages[i])) {
+      int velocity = messages[i].data[1];
+      noteOns++;
+      velocityTotal += velocity;
+      velocityMin = velocity < velocityMin ? velocity : velocityMin;
+      velocityMax = velocity > velocityMax ? velocity : velocityMax;
+    }
+  }
+
+  double seconds = simMicros(endCycle - startCycle) / 1e6;
+  long baud = simBaud();
+  printf("trace                      %u rows, %.3f s simulated\n", (unsigned int) rows.size(), seconds);
+  printf("tick                       %ld Hz, %lu passes, %u overruns", CONTROL_TICK_HZ, passes, tickOverruns);
+  if (scale > 0) {
+    printf(", %lu late at -k %g", latePasses, scale);
+  }
+  printf("\n");
+  printf("idle                       %lu times, %.1f%% of the time\n", idleEntries,
+         100.0 * simMicros(idleCycles) / 1e6 / seconds);
+  printf("breath                     rest %ld, noise %d, onset level %d\n",
+         (breathFloor + (1L << (BREATH_FLOOR_FRAC_BITS - 1))) >> BREATH_FLOOR_FRAC_BITS, breathNoise, breathOnsetLevel);
+  if (passes) {
+    double tickNs = 1e9 / CONTROL_TICK_HZ;
+    printf("loop pass (host)           mean %.0f ns, max %.0f ns (%.2f%% / %.2f%% of a tick)\n",
+           hostTotal / passes, hostWorst, 100 * hostTotal / passes / tickNs, 100 * hostWorst / tickNs);
+  }
+  printf("messages                   %u (%.1f/s)\n", (unsigned int) messages.size(), messages.size() / seconds);
+  printf("  note on / note off       %lu / %lu\n", noteOns, counts[0] + (counts[1] - noteOns));
+  if (noteOns) {
+    printf("  note on velocity         min %d, mean %lu, max %d\n", velocityMin, velocityTotal / noteOns, velocityMax);
+  }
+  printf("  control change           %lu\n", counts[3]);
+  printf("  pitch bend               %lu\n", counts[6]);
+  printf("  sysex                    %lu\n", sysex);
+  if (inPath) {
+    printf("  realtime                 %lu\n", realtime);
+    printf("midi in                    %u dropped\n", midiInDropped);
+  }
+  printf("bytes                      %u (%.1f/s, %.1f%% of %ld baud)\n", (unsigned int) bytes.size(),
+         bytes.size() / seconds, 100.0 * bytes.size() * 10 / (baud * seconds), baud);
+
+  LatencyStats stats;
+  measureNoteLatency(chordChanges, messages, stats);
+  printLatency("chord change -> note on", stats);
+  measureNoteLatency(breathOnsets, messages, stats);
+  printLatency("breath onset -> note on", stats);
+  BendStats bend;
+  measureBendError(rows, messages, bend);
+  if (bend.samples) {
+    printf("pitch bend vs slide        mean error %.0f, max %.0f (%.2f / %.2f semitones)\n", bend.total / bend.samples,
+           bend.worst, bend.total / bend.samples / PB_PER_SEMITONE, bend.worst / PB_PER_SEMITONE);
+  }
+  return 0;
+}
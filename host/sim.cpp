@@ -0,0 +1,461 @@
+/*
+
+Simulated ATmega328P for running the sketch on a host. See sim.h.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "WProgram.h"
+#include <avr/eeprom.h>
+
+#include "sim.h"
+
+#define HOST_REG8(name) volatile uint8_t name;
+HOST_REG8(PINB) HOST_REG8(DDRB) HOST_REG8(PORTB)
+HOST_REG8(PINC) HOST_REG8(DDRC) HOST_REG8(PORTC)
+HOST_REG8(PIND) HOST_REG8(DDRD) HOST_REG8(PORTD)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG8(TIMSK1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(TCNT2) HOST_REG8(OCR2A) HOST_REG8(TIMSK2) HOST_REG8(TIFR2)
+HOST_REG8(ADMUX) HOST_REG8(ADCSRA) HOST_REG8(ADCSRB) HOST_REG8(DIDR0)
+HOST_REG8(UCSR0A) HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UBRR0H) HOST_REG8(UBRR0L)
+HOST_REG8(PCICR) HOST_REG8(PCIFR) HOST_REG8(PCMSK0) HOST_REG8(PCMSK1) HOST_REG8(PCMSK2)
+HOST_REG8(SMCR) HOST_REG8(PRR) HOST_REG8(MCUSR) HOST_REG8(SREG)
+#undef HOST_REG8
+volatile uint16_t ADC;
+volatile uint16_t UBRR0;
+UdrRegister UDR0;
+Timer1Counter TCNT1;
+
+const unsigned int ADC_CONVERSION_CLOCKS = 13; // ADC clocks per conversion
+const uint8_t TIMER2_PRESCALE_SHIFT[8] = {0, 0, 3, 5, 6, 7, 8, 10}; // log2 of the CS2x prescaler (0 = stopped)
+const uint8_t TIMER1_PRESCALE_SHIFT[8] = {0, 0, 3, 6, 8, 10, 0, 0}; // log2 of the CS1x prescaler
+
+static uint64_t now = 0; // Current time in CPU cycles
+
+static std::vector<TraceRow> trace;
+static size_t traceIndex = 0; // Row in effect at the current time
+
+static bool tickArmed = false;
+static uint64_t tickAt = 0; // When Timer2 next matches
+
+static bool adcBusy = false;
+static uint64_t adcDoneAt = 0; // When the conversion in progress completes
+
+static bool txShifting = false;
+static uint64_t txShiftDoneAt = 0; // When the byte in the shift register is out
+static uint8_t txShiftByte = 0;
+static bool txHoldFull = false;
+static uint8_t txHoldByte = 0;
+static std::vector<SimTxByte> txBytes;
+
+const uint64_t RX_BYTE_CYCLES = 10ULL * F_CPU / 31250; // One byte at the MIDI baud rate
+static std::vector<SimTxByte> rxBytes; // Bytes due in on the receiver
+static size_t rxIndex = 0; // The next one to arrive
+static uint8_t rxData = 0; // The last one that did
+
+static uint16_t timer1Base = 0; // TCNT1 as last written
+static uint64_t timer1BaseCycle = 0; // When it was written
+
+static uint8_t eeprom[E2END + 1];
+static bool eepromErased = false;
+
+/**
+ * Load a trace file. Each line is
+ *
+ *   <time us> <breath> <slide> <x> <y> <PIND in hex>
+ *
+ * with the analog values as raw 0 - 1023 readings. Blank lines and lines
+ * starting with '#' are skipped.
+ */
+bool simLoadTrace(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char line[256];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineNumber++;
+    char *p = line;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+      continue;
+    }
+    TraceRow row;
+    unsigned int a[SIM_ANALOG_CHANNELS];
+    unsigned int port;
+    if (sscanf(p, "%lu %u %u %u %u %x", &row.time, &a[0], &a[1], &a[2], &a[3], &port) != 6) {
+      fprintf(stderr, "%s:%d: expected \"time breath slide x y port\"\n", path, lineNumber);
+      fclose(f);
+      return false;
+    }
+    if (!trace.empty() && row.time < trace.back().time) {
+      fprintf(stderr, "%s:%d: time goes backwards\n", path, lineNumber);
+      fclose(f);
+      return false;
+    }
+    for (int i = 0; i < SIM_ANALOG_CHANNELS; i++) {
+      row.analog[i] = a[i] > 1023 ? 1023 : a[i];
+    }
+    row.port = port;
+    trace.push_back(row);
+  }
+  fclose(f);
+  if (trace.empty()) {
+    fprintf(stderr, "%s: no samples\n", path);
+    return false;
+  }
+  traceIndex = 0;
+  PIND = trace[0].port;
+  return true;
+}
+
+/**
+ * Load bytes for the UART to receive. Each line is
+ *
+ *   <time us> <byte in hex> ...
+ *
+ * The bytes go in back to back at 31250 baud, starting at that time or
+ * when the line before has finished, whichever is later. Blank lines
+ * and lines starting with '#' are skipped.
+ */
+bool simLoadMidiIn(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char line[1024];
+  int lineNumber = 0;
+  uint64_t lineFree = 0; // When the line is free for the next byte
+  while (fgets(line, sizeof(line), f)) {
+    lineNumber++;
+    char *p = line;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+      continue;
+    }
+    unsigned long us;
+    int used;
+    if (sscanf(p, "%lu%n", &us, &used) != 1) {
+      fprintf(stderr, "%s:%d: expected \"time byte...\"\n", path, lineNumber);
+      fclose(f);
+      return false;
+    }
+    p += used;
+    uint64_t at = (uint64_t) us * (F_CPU / 1000000L);
+    if (at < lineFree) {
+      at = lineFree;
+    }
+    unsigned int value;
+    while (sscanf(p, "%x%n", &value, &used) == 1) {
+      p += used;
+      at += RX_BYTE_CYCLES;
+      SimTxByte in = {at, (uint8_t) value};
+      rxBytes.push_back(in);
+    }
+    lineFree = at;
+  }
+  fclose(f);
+  rxIndex = 0;
+  return true;
+}
+
+const std::vector<TraceRow> &simTrace() {
+  return trace;
+}
+
+uint64_t simNow() {
+  return now;
+}
+
+double simMicros(uint64_t cycle) {
+  return cycle / (F_CPU / 1000000.0);
+}
+
+/**
+ * Cycle count of a trace timestamp.
+ */
+static uint64_t traceCycle(unsigned long us) {
+  return (uint64_t) us * (F_CPU / 1000000L);
+}
+
+/**
+ * The trace row in effect now.
+ */
+static const TraceRow &currentRow() {
+  return trace[traceIndex];
+}
+
+long simBaud() {
+  unsigned int ubrr = UBRR0 ? UBRR0 : ((UBRR0H << 8) | UBRR0L);
+  return F_CPU / ((UCSR0A & _BV(U2X0)) ? 8 : 16) / (ubrr + 1);
+}
+
+static uint64_t txByteCycles() {
+  unsigned int ubrr = UBRR0 ? UBRR0 : ((UBRR0H << 8) | UBRR0L);
+  return 10ULL * ((UCSR0A & _BV(U2X0)) ? 8 : 16) * (ubrr + 1);
+}
+
+const std::vector<SimTxByte> &simTxBytes() {
+  return txBytes;
+}
+
+static void txLoad(uint8_t value) {
+  if (!txShifting) {
+    txShifting = true;
+    txShiftByte = value;
+    txShiftDoneAt = now + txByteCycles();
+  } else {
+    txHoldFull = true;
+    txHoldByte = value;
+  }
+}
+
+UdrRegister &UdrRegister::operator=(uint8_t value) {
+  txLoad(value);
+  return *this;
+}
+
+UdrRegister::operator uint8_t() const {
+  UCSR0A &= ~(_BV(RXC0) | _BV(FE0) | _BV(DOR0));
+  return rxData;
+}
+
+Timer1Counter &Timer1Counter::operator=(uint16_t value) {
+  timer1Base = value;
+  timer1BaseCycle = now;
+  return *this;
+}
+
+Timer1Counter::operator uint16_t() const {
+  uint8_t cs = TCCR1B & 7;
+  if (cs == 0 || cs > 5) {
+    return timer1Base;
+  }
+  return timer1Base + (uint16_t) ((now - timer1BaseCycle) >> TIMER1_PRESCALE_SHIFT[cs]);
+}
+
+/**
+ * Bring the peripheral state up to date with registers the sketch may
+ * have written since the last event: a timer that's just been started,
+ * a conversion that's just been requested.
+ */
+static void notice() {
+  uint8_t cs2 = TCCR2B & 7;
+  if (cs2 && (TIMSK2 & _BV(OCIE2A))) {
+    if (!tickArmed) {
+      tickArmed = true;
+      tickAt = now + ((uint64_t) (OCR2A + 1) << TIMER2_PRESCALE_SHIFT[cs2]);
+    }
+  } else {
+    tickArmed = false;
+  }
+  if ((ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADSC))) {
+    if (!adcBusy) {
+      adcBusy = true;
+      uint8_t adps = ADCSRA & 7;
+      adcDoneAt = now + ((uint64_t) ADC_CONVERSION_CLOCKS << (adps ? adps : 1));
+    }
+  }
+  if (txHoldFull || txShifting) {
+    UCSR0A &= ~_BV(UDRE0);
+  }
+  if (!txHoldFull) {
+    UCSR0A |= _BV(UDRE0);
+  }
+}
+
+/**
+ * Find the time of the next peripheral event. Returns false if nothing
+ * is pending.
+ */
+static bool nextEvent(uint64_t &at) {
+  notice();
+  if ((UCSR0B & _BV(UDRIE0)) && !txHoldFull) {
+    at = now;
+    return true;
+  }
+  bool pending = false;
+  if (tickArmed) {
+    at = tickAt;
+    pending = true;
+  }
+  if (adcBusy && (!pending || adcDoneAt < at)) {
+    at = adcDoneAt;
+    pending = true;
+  }
+  if (txShifting && (!pending || txShiftDoneAt < at)) {
+    at = txShiftDoneAt;
+    pending = true;
+  }
+  if (rxIndex < rxBytes.size() && (!pending || rxBytes[rxIndex].cycle < at)) {
+    at = rxBytes[rxIndex].cycle;
+    pending = true;
+  }
+  if (traceIndex + 1 < trace.size()) {
+    uint64_t rowAt = traceCycle(trace[traceIndex + 1].time);
+    if (!pending || rowAt < at) {
+      at = rowAt;
+      pending = true;
+    }
+  }
+  if (pending && at < now) {
+    at = now;
+  }
+  return pending;
+}
+
+/**
+ * Move the trace along to the row in effect at the current time.
+ */
+static void followTrace() {
+  while (traceIndex + 1 < trace.size() && traceCycle(trace[traceIndex + 1].time) <= now) {
+    traceIndex++;
+    uint8_t changed = PIND ^ currentRow().port;
+    PIND = currentRow().port;
+    if ((changed & PCMSK2) && (PCICR & _BV(PCIE2)) && PCINT2_vect) {
+      PCINT2_vect();
+    }
+  }
+}
+
+/**
+ * Advance the clock to the next event and handle it. Returns false if
+ * nothing is pending.
+ */
+bool simStep() {
+  uint64_t at;
+  if (!nextEvent(at)) {
+    return false;
+  }
+  now = at;
+  followTrace();
+  if ((UCSR0B & _BV(UDRIE0)) && !txHoldFull) {
+    USART_UDRE_vect();
+    return true;
+  }
+  if (txShifting && txShiftDoneAt == now) {
+    SimTxByte out = {now, txShiftByte};
+    txBytes.push_back(out);
+    txShifting = false;
+    if (txHoldFull) {
+      txHoldFull = false;
+      txLoad(txHoldByte);
+    }
+  }
+  if (rxIndex < rxBytes.size() && rxBytes[rxIndex].cycle == now) {
+    if (UCSR0B & _BV(RXEN0)) {
+      if (UCSR0A & _BV(RXC0)) {
+        UCSR0A |= _BV(DOR0);
+      }
+      rxData = rxBytes[rxIndex].value;
+      UCSR0A |= _BV(RXC0);
+      if ((UCSR0B & _BV(RXCIE0)) && USART_RX_vect) {
+        USART_RX_vect();
+      }
+    }
+    rxIndex++;
+  }
+  if (tickArmed && tickAt == now) {
+    tickAt += (uint64_t) (OCR2A + 1) << TIMER2_PRESCALE_SHIFT[TCCR2B & 7];
+    if (TIMER2_COMPA_vect) {
+      TIMER2_COMPA_vect();
+    }
+  }
+  if (adcBusy && adcDoneAt == now) {
+    adcBusy = false;
+    uint8_t channel = ADMUX & 0x0f;
+    ADC = channel < SIM_ANALOG_CHANNELS ? currentRow().analog[channel] : 0;
+    ADCSRA &= ~_BV(ADSC);
+    if ((ADCSRA & _BV(ADIE)) && ADC_vect) {
+      ADC_vect();
+    } else {
+      ADCSRA |= _BV(ADIF);
+    }
+  }
+  return true;
+}
+
+/**
+ * Handle every event up to the given cycle, then leave the clock there.
+ */
+void simRunUntil(uint64_t cycle) {
+  uint64_t at;
+  while (nextEvent(at) && at <= cycle) {
+    simStep();
+  }
+  if (cycle > now) {
+    now = cycle;
+  }
+  followTrace();
+}
+
+void hostWaitForInterrupt() {
+  if (!simStep()) {
+    fprintf(stderr, "sim: waiting for an interrupt, but none can happen\n");
+    exit(1);
+  }
+}
+
+// The Arduino core
+
+void init() {
+  SREG = 0x80;
+  UCSR0A = _BV(UDRE0);
+}
+
+unsigned long millis() {
+  return now / (F_CPU / 1000L);
+}
+
+unsigned long micros() {
+  return now / (F_CPU / 1000000L);
+}
+
+void delay(unsigned long ms) {
+  simRunUntil(now + (uint64_t) ms * (F_CPU / 1000L));
+}
+
+void delayMicroseconds(unsigned int us) {
+  simRunUntil(now + (uint64_t) us * (F_CPU / 1000000L));
+}
+
+// EEPROM
+
+static void eepromErase() {
+  if (!eepromErased) {
+    memset(eeprom, 0xff, sizeof(eeprom));
+    eepromErased = true;
+  }
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+  eepromErase();
+  memcpy(dst, eeprom + (size_t) src, n);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n) {
+  eepromErase();
+  memcpy(eeprom + (size_t) dst, src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+  eeprom_write_block(src, dst, n);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+  eepromErase();
+  return eeprom[(size_t) addr];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+  eepromErase();
+  eeprom[(size_t) addr] = value;
+}
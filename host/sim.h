@@ -0,0 +1,67 @@
+/*
+
+Simulated ATmega328P for running the sketch on a host.
+
+Time is counted in CPU cycles at F_CPU. Nothing happens to the clock
+while sketch code runs; it only moves when the harness lets it (between
+passes of loop(), or when the sketch spins in WAIT_FOR_INTERRUPT()), and
+interrupts only run then too. On the board an ISR can land anywhere in
+a pass: a UDRE can put a byte on the wire partway through queueing a
+burst, and a sample can arrive partway through reading the controllers.
+So the order and spacing of bytes on the wire within a pass can differ
+from the hardware's, and the latencies replay reports are the model's,
+not the board's. The peripherals the sketch uses are modelled at the
+level it depends on:
+
+- Timer2 in CTC mode raises TIMER2_COMPA_vect every (OCR2A + 1) *
+  prescale cycles.
+- The ADC takes 13 ADC clocks per conversion, returns the trace value
+  for the channel in ADMUX, and raises ADC_vect.
+- USART0 has a holding register and a shift register. UDRE fires while
+  the holding register is empty; each byte takes 10 bit times at the
+  baud rate set in UBRR0. Every byte is logged with the cycle its stop
+  bit finished.
+- Its receiver takes bytes from a MIDI input file, if one is loaded, at
+  31250 baud, and raises USART_RX_vect as each one arrives. A byte not
+  read before the next arrives is lost, with DOR0 set.
+- PIND follows the switch column of the trace, raising PCINT2_vect
+  when a pin in PCMSK2 changes and PCIE2 is set.
+- Sleeping waits for the next event, like WAIT_FOR_INTERRUPT().
+
+*/
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stdint.h>
+#include <vector>
+
+const int SIM_ANALOG_CHANNELS = 4; // Analog pins 0 - 3 are in the trace
+
+/**
+ * One line of a sensor trace. Each row holds until the next one.
+ */
+struct TraceRow {
+  unsigned long time; // Microseconds from the start of the trace
+  uint16_t analog[SIM_ANALOG_CHANNELS]; // Analog pins 0 - 3 (breath, slide, X, Y)
+  uint8_t port; // PIND
+};
+
+/**
+ * A byte that finished going out of the UART, or coming in.
+ */
+struct SimTxByte {
+  uint64_t cycle; // When the stop bit finished
+  uint8_t value;
+};
+
+bool simLoadTrace(const char *path);
+bool simLoadMidiIn(const char *path);
+const std::vector<TraceRow> &simTrace();
+uint64_t simNow();
+double simMicros(uint64_t cycle);
+void simRunUntil(uint64_t cycle);
+bool simStep();
+long simBaud();
+const std::vector<SimTxByte> &simTxBytes();
+
+#endif